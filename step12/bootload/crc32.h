@@ -0,0 +1,17 @@
+#ifndef _CRC32_H_INCLUDED_
+#define _CRC32_H_INCLUDED_
+
+// CRC-32（イーサネットやzipと同じ．多項式0xedb88320のビット反転版，初期値と最後の反転は0xffffffff）
+// 受信しながら1バイトずつ計算できるように，途中の値を渡して続きを計算する
+
+#define CRC32_INIT 0xffffffffUL
+
+extern const uint32 crc32_table[256];
+
+// 1バイト加える（関数呼び出しをしない分速い．1バイトごとに受信する所で使う）
+#define CRC32_BYTE(crc, c) (crc32_table[((unsigned char)(crc) ^ (unsigned char)(c))] ^ ((crc) >> 8))
+
+uint32 crc32_update(uint32 crc, const char *buf, long len); // lenバイト加える
+#define crc32_final(crc) ((crc) ^ 0xffffffffUL)				// 最後の値（反転する）
+
+#endif
@@ -6,6 +6,7 @@
 
 #define NULL ((void *)0)		// NULLポインタの定義
 #define SERIAL_DEFAULT_DEVICE 1 // 標準のシリアルデバイス
+#define CPU_CLOCK 20000000		// CPUのクロック周波数（水晶振動子を25MHzに入れ替えた場合は25000000）
 
 // ビット幅固の整数型
 typedef unsigned char uint8;
@@ -1,6 +1,11 @@
 #include "defines.h"
 #include "elf.h"
 #include "lib.h"
+#include "dram.h"
+
+// ロードしてよい内蔵RAMの範囲（リンカスクリプトのramall）
+#define ELF_RAM_START 0xffbf20
+#define ELF_RAM_END 0xffff20
 
 struct elf_header
 {
@@ -77,75 +82,237 @@ static int elf_check(struct elf_header *header)
 	return 0;
 }
 
-// プログラム・ヘッダの解析
-// セグメント単位でのロード
-static int elf_load_program(struct elf_header *header)
+// ストリーミングでのロード ---------------------------------------------------------------------
+
+/*
+	以前はXMODEMで受信したファイル全体をバッファに溜めてから，セグメントをコピーしていた
+	（バッファの大きさでOSのサイズが制限され，全バイトを2回コピーしていた）
+	今はブロックを受信するたびにelf_stream_write()を呼び，セグメントのデータを直接物理アドレスに書き込む
+	ELFヘッダとプログラム・ヘッダはファイルの先頭にあるので，そこまでは作業領域に取っておき，
+	プログラム・ヘッダが揃ったら，それまでに受信したセグメントの部分を作業領域から書き込む
+*/
+
+static struct
 {
-	int i;
+	char *work;	 // 作業領域（先頭にELFヘッダとプログラム・ヘッダを取っておく）
+	long size;	 // 作業領域のサイズ（セグメントが重なってはいけない）
+	long pos;	 // ここまでに受信したファイルのサイズ
+	int ready;	 // プログラム・ヘッダが揃ったか
+	int error;	 // エラーが起きたか（以降のデータは捨てる）
+	int dram;	 // DRAMにもロードしてよいか
+} stream;
+
+// プログラム・ヘッダの終わりのファイル中の位置（先頭部分に収まらなければ-1）
+// 掛け算が32ビットにならないように，個数を先に制限してから16ビットで計算する
+static long elf_program_header_end(struct elf_header *header)
+{
+	if (header->program_header_size != sizeof(struct elf_program_header))
+		return -1;
+	if (header->program_header_num < 0 || header->program_header_num > ELF_STREAM_HEADER_SIZE / sizeof(struct elf_program_header))
+		return -1;
+	if (header->program_header_offset < 0 || header->program_header_offset > ELF_STREAM_HEADER_SIZE)
+		return -1;
+	if (header->program_header_offset + header->program_header_size * header->program_header_num > ELF_STREAM_HEADER_SIZE)
+		return -1;
+	return header->program_header_offset + header->program_header_size * header->program_header_num;
+}
+
+// 範囲が重なっているか
+static int elf_overlap(long start1, long size1, long start2, long size2)
+{
+	return (start1 < start2 + size2) && (start2 < start1 + size1);
+}
+
+// 範囲がすべて[start, start + size)に収まっているか
+static int elf_inside(long addr, long len, long start, long size)
+{
+	return (addr >= start) && (addr + len <= start + size);
+}
+
+// ロード可能なセグメントの検査
+// - ファイル中のサイズがメモリ上のサイズを超えていないか
+// - 内蔵RAM（DRAMが使えればDRAMも）に収まっているか（ROMやI/Oの領域に書き込まないように）
+// - ブートローダが使っている領域に重なっていないか
+//	 受信中にブートローダの変数やスタック，作業領域を上書きすると，受信を続けられなくなる
+static int elf_check_program(struct elf_header *header)
+{
+	extern int data_start, bootstack;
 	struct elf_program_header *phdr;
+	int i;
 
-	// セグメント単位でループ
-	// セグメント情報の実体は，プログラム・ヘッダの集まり．
+	phdr = (struct elf_program_header *)((char *)header + header->program_header_offset);
 	for (i = 0; i < header->program_header_num; i++)
 	{
-		// プログラムヘッダを取得 (これも構造体のポインタを利用することで，アクセス)
-		//                                           ↓ アドレス
-		phdr = (struct elf_program_header *)((char *)header + header->program_header_offset + header->program_header_size * i);
+		if (phdr->type == 1)
+		{
+			if (phdr->file_size < 0 || phdr->memory_size < phdr->file_size)
+				return -1;
+			if (!elf_inside(phdr->physical_addr, phdr->memory_size, ELF_RAM_START, ELF_RAM_END - ELF_RAM_START) &&
+				!(stream.dram && elf_inside(phdr->physical_addr, phdr->memory_size, DRAM_START, DRAM_SIZE)))
+				return -1;
+			if (elf_overlap(phdr->physical_addr, phdr->memory_size, (long)&data_start, (long)&bootstack - (long)&data_start))
+				return -1;
+			if (elf_overlap(phdr->physical_addr, phdr->memory_size, (long)stream.work, stream.size))
+				return -1;
+		}
+		phdr = (struct elf_program_header *)((char *)phdr + header->program_header_size);
+	}
+
+	return 0;
+}
 
+// ファイル中のposからsizeバイトのデータ（buf）のうち，セグメントに含まれる部分を物理アドレスに書き込む
+static void elf_load_program(char *buf, long pos, long size)
+{
+	struct elf_header *header = (struct elf_header *)stream.work;
+	struct elf_program_header *phdr;
+	long start, end;
+	int i;
+
+	phdr = (struct elf_program_header *)((char *)header + header->program_header_offset);
+	for (i = 0; i < header->program_header_num; i++)
+	{
 		// ロード可能か？
-		if (phdr->type != 1)
-			continue;
-
-		// とりあえず実験用に，実際にロードせずにセグメント情報を表示する
-		// putxval(phdr->offset, 6);
-		// puts(" ");
-		// putxval(phdr->virtual_addr, 8);
-		// puts(" ");
-		// putxval(phdr->physical_addr, 8);
-		// puts(" ");
-		// putxval(phdr->file_size, 5);
-		// puts(" ");
-		// putxval(phdr->memory_size, 5);
-		// puts(" ");
-		// putxval(phdr->flags, 2);
-		// puts(" ");
-		// putxval(phdr->align, 2);
-		// puts(" ");
-
-		// VA == PA なのでどっちでもいい
-		// 実行ファイル（ELF形式）をセグメント単位で物理メモリ上にコピー
-		// 物理アドレス = プログラムヘッダアドレス + 各セグメントまでのオフセット (セグメントのサイズ分)
-		memcpy((char *)phdr->physical_addr, (char *)header + phdr->offset, phdr->file_size);
-
-		// BSS領域は，メモリ上に展開はされるが実行形式ファイル上ではサイズがゼロになっている．（サイズ情報だけを持つ）そのため，「ファイル中のサイズ != メモリ上のサイズ」となる場合がある．
-		// また，サイズ節約のためにセグメント単位で圧縮処理が行われているときは，「ファイル中のサイズ != メモリ上のサイズ」となる．
-		// ファイルサイズがメモリサイズに満たない場合，余った領域をゼロクリア
-		// （物理アドレス＋ファイルサイズ）のアドレスから余った領域をゼロクリア
-		// ゼロクリア ... 多くの場合，「値のゼロ・ NULLポインタ」はメモリ上のバイトパターンもゼロ -> 「初期化なしの変数はゼロ，ポインタの場合はNULLポインタ」として初期化できる．
-		memset((char *)phdr->physical_addr + phdr->file_size, 0, phdr->memory_size - phdr->file_size);
+		if (phdr->type == 1)
+		{
+			// このセグメントとbufの重なっている部分
+			start = (pos > phdr->offset) ? pos : phdr->offset;
+			end = phdr->offset + phdr->file_size;
+			if (end > pos + size)
+				end = pos + size;
+			// VA == PA なのでどっちでもいい
+			if (start < end)
+				memcpy((char *)phdr->physical_addr + (start - phdr->offset), buf + (start - pos), end - start);
+		}
+		phdr = (struct elf_program_header *)((char *)phdr + header->program_header_size);
+	}
+}
+
+// どこから？
+// 『bootload/main.c』の『main関数（loadコマンド）』
+// ストリーミングでのロードの開始
+// workからsizeバイトは作業領域として使う（XMODEMの受信バッファも含めておくこと）
+// dramが0以外なら，DRAMに置くセグメントも受け付ける
+void elf_stream_start(char *work, long size, int dram)
+{
+	stream.work = work;
+	stream.size = size;
+	stream.dram = dram;
+	stream.pos = 0;
+	stream.ready = 0;
+	stream.error = 0;
+}
+
+// どこから？
+// 『xmodem.c』の『xmodem_recv関数』（ブロックを受信するたびに呼ばれる）
+// 受信したデータをセグメントに書き込む．ELFでない・ロードできない場合は-1を返す（受信を中断する）
+int elf_stream_write(char *buf, int size)
+{
+	struct elf_header *header = (struct elf_header *)stream.work;
+	long pos = stream.pos;
+	long n;
+
+	if (stream.error)
+		return -1;
+
+	// 先頭部分（ELFヘッダとプログラム・ヘッダ）を取っておく
+	if (pos < ELF_STREAM_HEADER_SIZE)
+	{
+		n = ELF_STREAM_HEADER_SIZE - pos;
+		if (n > size)
+			n = size;
+		memcpy(stream.work + pos, buf, n);
+	}
+	stream.pos += size;
+
+	if (!stream.ready)
+	{
+		// ELFヘッダが揃うまで待つ
+		if (stream.pos < sizeof(struct elf_header))
+			return 0;
+		// ELFヘッダのチェック（プログラム・ヘッダは先頭部分に収まっていること）
+		if (elf_check(header) < 0 || elf_program_header_end(header) < 0)
+		{
+			stream.error = 1;
+			return -1;
+		}
+		// プログラム・ヘッダが揃うまで待つ
+		if (stream.pos < elf_program_header_end(header))
+			return 0;
+		if (elf_check_program(header) < 0)
+		{
+			stream.error = 1;
+			return -1;
+		}
+		stream.ready = 1;
+
+		// これまでに受信した部分のうち，先頭部分に取ってある分を書き込む
+		n = (stream.pos < ELF_STREAM_HEADER_SIZE) ? stream.pos : ELF_STREAM_HEADER_SIZE;
+		elf_load_program(stream.work, 0, n);
+		// 先頭部分に入りきらなかった残り（今回受信したブロックの後ろの方）
+		if (stream.pos > ELF_STREAM_HEADER_SIZE)
+			elf_load_program(buf + (ELF_STREAM_HEADER_SIZE - pos), ELF_STREAM_HEADER_SIZE, stream.pos - ELF_STREAM_HEADER_SIZE);
+		return 0;
 	}
 
+	elf_load_program(buf, pos, size);
+
 	return 0;
 }
 
-// ELF形式の解析
-// エントリ・ポインタのアドレスを返す
-char *elf_load(char *buf)
+// ゼロクリア（BSS領域用）
+// memset()は1バイトずつ書くので，偶数アドレスからは4バイトずつ書く（H8/300Hのlongは2バイト境界でよい）
+// OSはBSS領域をクリアしないので，ここでクリアした状態でmainから始められる
+static void elf_zero(char *p, long size)
 {
-	// ELF形式を保存したバッファのアドレス
-	// アドレスを構造体へのポインタにキャストすることで，構造体を利用してのフォーマット解析が可能に．．．え，なんでバッファのアドレスから構造体にキャストして利用できるの？？？？ -> バッファないで並んでるバイトの順番を考慮して，構造体を定義しているからそこに綺麗に当てはまる？？
-	struct elf_header *header = (struct elf_header *)buf;
+	long *lp;
 
-	// ELFヘッダのチェック
-	if (elf_check(header) < 0)
-		// return -1;
-		return NULL;
+	if (size > 0 && ((long)p & 1))
+	{
+		*(p++) = 0;
+		size--;
+	}
+	for (lp = (long *)p; size >= 4; size -= 4)
+		*(lp++) = 0;
+	for (p = (char *)lp; size > 0; size--)
+		*(p++) = 0;
+}
+
+// どこから？
+// 『bootload/main.c』の『main関数（loadコマンド）』
+// 受信が終わったら呼ぶ
+// エントリ・ポイントのアドレスを返す（セグメントが揃っていなければNULL）
+char *elf_stream_end(void)
+{
+	struct elf_header *header = (struct elf_header *)stream.work;
+	struct elf_program_header *phdr;
+	int i;
 
-	// セグメント単位でのロード
-	if (elf_load_program(header) < 0)
-		// return -1;
+	if (stream.error || !stream.ready)
 		return NULL;
 
-	// return 0;
+	phdr = (struct elf_program_header *)((char *)header + header->program_header_offset);
+	for (i = 0; i < header->program_header_num; i++)
+	{
+		if (phdr->type == 1)
+		{
+			// 途中で受信が終わっている
+			if (stream.pos < phdr->offset + phdr->file_size)
+				return NULL;
+
+			// BSS領域は，メモリ上に展開はされるが実行形式ファイル上ではサイズがゼロになっている．（サイズ情報だけを持つ）そのため，「ファイル中のサイズ != メモリ上のサイズ」となる場合がある．
+			// ファイルサイズがメモリサイズに満たない場合，余った領域をゼロクリア
+			// （物理アドレス＋ファイルサイズ）のアドレスから余った領域をゼロクリア
+			elf_zero((char *)phdr->physical_addr + phdr->file_size, phdr->memory_size - phdr->file_size);
+		}
+		phdr = (struct elf_program_header *)((char *)phdr + header->program_header_size);
+	}
+
 	return (char *)header->entry_point;
 }
+
+// 取っておいたファイルの先頭部分（ELFヘッダとプログラム・ヘッダ）のサイズ
+long elf_stream_header_size(void)
+{
+	return (stream.pos < ELF_STREAM_HEADER_SIZE) ? stream.pos : ELF_STREAM_HEADER_SIZE;
+}
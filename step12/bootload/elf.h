@@ -1,6 +1,12 @@
 #ifndef _ELF_H_INCLUDED_
 #define _ELF_H_INCLUDED_
 
-char *elf_load(char *buf);
+// 作業領域の先頭に取っておくファイルの先頭部分のサイズ（ELFヘッダとプログラム・ヘッダが収まること）
+#define ELF_STREAM_HEADER_SIZE 512
+
+void elf_stream_start(char *work, long size, int dram); // ストリーミングでのロードの開始（workからsizeバイトを作業領域として使う）
+int elf_stream_write(char *buf, int size);	  // 受信したデータの書き込み（エラーなら-1）
+char *elf_stream_end(void);					  // ロードの終了（エントリ・ポイントを返す．エラーならNULL）
+long elf_stream_header_size(void);			  // 取っておいたファイルの先頭部分のサイズ
 
 #endif
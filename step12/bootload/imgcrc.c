@@ -0,0 +1,72 @@
+// イメージの末尾に付けたCRC-32による検査
+
+#include "defines.h"
+#include "lib.h"
+#include "crc32.h"
+#include "imgcrc.h"
+
+// マジックナンバ（"KZCR"を32ビットの値として見たもの）
+#define IMGCRC_MAGIC_VALUE 0x4b5a4352UL
+
+static struct
+{
+	uint32 crc;		  // ここまでのCRC-32
+	uint32 hist[4];	  // 直前の4バイトそれぞれの手前までのCRC-32（マジックナンバの手前の値を知るため）
+	uint32 tail;	  // 直前の4バイト（1バイトずつ左にずらして入れる）
+	long pos;		  // ここまでのサイズ
+	long magic;		  // マジックナンバを見つけた位置（-1なら無し）
+	long magic_size;  // マジックナンバの後ろのサイズ
+	uint32 magic_crc; // マジックナンバの手前までのCRC-32
+	int result;
+} ic;
+
+// どこから？
+// 『bootload/main.c』の『main関数（load, sloadコマンド）』
+void imgcrc_start(void)
+{
+	memset(&ic, 0, sizeof(ic));
+	ic.crc = CRC32_INIT;
+	ic.magic = -1;
+	ic.result = IMGCRC_NONE;
+}
+
+// どこから？
+// 『bootload/main.c』の『load_write関数』（ブロックを受信するたびに呼ばれる）
+// 受信したデータを加える
+// sloadでは受信の合間に呼ばれるので，1バイトあたりの処理は少なくしておく（比較は32ビットの値で1回）
+void imgcrc_write(char *buf, int size)
+{
+	unsigned char c;
+
+	for (; size > 0; size--)
+	{
+		c = *(buf++);
+		ic.hist[ic.pos & 3] = ic.crc;
+		ic.crc = CRC32_BYTE(ic.crc, c);
+		ic.tail = (ic.tail << 8) | c;
+		ic.pos++;
+
+		// マジックナンバを見つけたら，その手前までのCRC-32を覚えておく
+		if (ic.tail == IMGCRC_MAGIC_VALUE && ic.pos >= 4)
+		{
+			ic.magic = ic.pos - 4;
+			ic.magic_crc = ic.hist[ic.magic & 3];
+		}
+		else if (ic.magic >= 0)
+		{
+			// マジックナンバの後ろのサイズ
+			if (ic.pos == ic.magic + 8)
+				ic.magic_size = ic.tail;
+			// 位置とサイズが合わなければ，たまたまイメージの中にあったマジックナンバ
+			else if (ic.pos == ic.magic + IMGCRC_TRAILER_SIZE && ic.magic_size == ic.magic)
+				ic.result = (ic.tail == crc32_final(ic.magic_crc)) ? IMGCRC_OK : IMGCRC_ERROR;
+		}
+	}
+}
+
+// どこから？
+// 『bootload/main.c』の『main関数（load, sloadコマンド）』
+int imgcrc_end(void)
+{
+	return ic.result;
+}
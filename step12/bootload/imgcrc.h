@@ -0,0 +1,27 @@
+#ifndef _IMGCRC_H_INCLUDED_
+#define _IMGCRC_H_INCLUDED_
+
+/*
+	イメージの末尾に付けたCRC-32による検査（付けるのはホスト側のツール tools/kzcrc.c）
+	トレイラ（12バイト）
+		- 4バイト : マジックナンバ "KZCR"
+		- 4バイト : トレイラより前のサイズ（ビッグエンディアン）
+		- 4バイト : トレイラより前のCRC-32（ビッグエンディアン）
+	XMODEMでは後ろに埋め草（0x1a）が付いてファイルの終わりが分からないので，
+	受信しながらマジックナンバを探し，その位置とサイズが一致するものをトレイラとみなす
+	CRC-32は受信しながら1バイトずつ計算するので，受信後にイメージを読み直す必要は無い
+*/
+
+#define IMGCRC_MAGIC "KZCR"
+#define IMGCRC_TRAILER_SIZE 12
+
+// 検査の結果
+#define IMGCRC_OK 0
+#define IMGCRC_ERROR -1
+#define IMGCRC_NONE 1 // トレイラが無い（古いイメージ）
+
+void imgcrc_start(void);				 // 検査の開始
+void imgcrc_write(char *buf, int size); // 受信したデータを加える
+int imgcrc_end(void);					 // 検査の結果（IMGCRC_OKなど）
+
+#endif
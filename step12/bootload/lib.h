@@ -15,6 +15,12 @@ char *strcpy(char *dst, const char *src);			  // 文字列のコピー(コピー
 int strcmp(const char *s1, const char *s2);			  // 文字列の比較（比較元の文字型配列のポインタ， 比較元の文字型配列のポインタ) s1 > s2 正, s1 < s2 負, s1 = s2 0
 int strncmp(const char *s1, const char *s2, int len); // 長さ指定での文字列の比較(比較文字列， 比較文字列，　　比較文字数) s1 > s2 正, s1 < s2 負, s1 = s2 0
 
+unsigned long udivmod(unsigned long n, unsigned long d, unsigned long *rem); // 32ビットの割り算（商を返し，余りを*remに格納）
+unsigned long atoul(const char *s);										   // 10進数の文字列を数値に変換
+int ultostr(unsigned long value, char *buf);							   // 数値を10進数の文字列に変換（戻り値は長さ）
+unsigned long xtoul(const char *s, char **endp);						   // 16進数の文字列を数値に変換
+char *ultoxstr(unsigned long value, char *buf, int column);				   // 数値をcolumn桁の16進数の文字列に（書いた後の位置を返す）
+
 int putc(unsigned char c);	  // 1文字送信
 unsigned char getc(void);	  // 1文字受信
 int puts(unsigned char *str); // 文字列送信
@@ -0,0 +1,165 @@
+// LZSSで圧縮したイメージの展開
+
+#include "defines.h"
+#include "lib.h"
+#include "lzss.h"
+
+/*
+	XMODEMのブロックを受信するたびに呼ばれるので，途中の状態を保存しながら1バイトずつ展開する
+	展開したデータはスライド窓（リングバッファ）に書き込み，溜まったらまとめてfuncに渡す
+	（ELFのセグメントは飛び飛びのアドレスに置かれるので，過去のデータの参照には窓が必要）
+*/
+
+#define LZSS_WINDOW_MASK (LZSS_WINDOW_SIZE - 1)
+#define LZSS_THRESHOLD 3 // 参照の最小の長さ
+
+// 窓にこれだけ溜まったらfuncに渡す（窓を一周して渡す前のデータを上書きしないように）
+// sloadでは受信の合間に展開するので，一度に渡す量を小さくして1回の処理時間を短くしておく
+#define LZSS_FLUSH_SIZE 64
+
+static struct
+{
+	char *window;
+	int (*func)(char *buf, int size);
+	unsigned int pos;	  // 窓の書き込み位置（マスクして使う）
+	unsigned int flushed; // funcに渡し終えた位置
+	long remain;		  // 残りの展開後のサイズ
+	int header;			  // 受信したヘッダのバイト数
+	unsigned char hdr[LZSS_HEADER_SIZE];
+	unsigned int flags; // フラグ（上位8ビットは残りのビット数の目印）
+	int first;			// 参照の1バイト目（-1なら無し）
+	int error;
+} lz;
+
+// 窓に溜まっている分をfuncに渡す（窓の終わりで折り返している時は2回に分ける）
+static int lzss_flush(void)
+{
+	unsigned int start, len;
+
+	while (lz.flushed != lz.pos)
+	{
+		start = lz.flushed & LZSS_WINDOW_MASK;
+		len = lz.pos - lz.flushed;
+		if (len > LZSS_WINDOW_SIZE - start)
+			len = LZSS_WINDOW_SIZE - start;
+		if (lz.func(lz.window + start, len) < 0)
+			return -1;
+		lz.flushed += len;
+	}
+
+	return 0;
+}
+
+// 展開した1バイトを窓に書き込む
+static int lzss_put(char c)
+{
+	lz.window[(lz.pos++) & LZSS_WINDOW_MASK] = c;
+	lz.remain--;
+	if (lz.pos - lz.flushed >= LZSS_FLUSH_SIZE)
+		return lzss_flush();
+	return 0;
+}
+
+// どこから？
+// 『bootload/main.c』の『main関数（loadコマンド）』
+// 展開の開始
+void lzss_stream_start(char *window, int (*func)(char *buf, int size))
+{
+	lz.window = window;
+	lz.func = func;
+	lz.pos = 0;
+	lz.flushed = 0;
+	lz.remain = 0;
+	lz.header = 0;
+	lz.flags = 0;
+	lz.first = -1;
+	lz.error = 0;
+}
+
+// どこから？
+// 『xmodem.c』の『xmodem_recv関数』（ブロックを受信するたびに呼ばれる）
+// 圧縮データの展開
+int lzss_stream_write(char *buf, int size)
+{
+	unsigned char c;
+	unsigned int dist;
+	int i, len;
+
+	if (lz.error)
+		return -1;
+
+	for (i = 0; i < size; i++)
+	{
+		c = buf[i];
+
+		// ヘッダ（マジックナンバと展開後のサイズ）
+		if (lz.header < LZSS_HEADER_SIZE)
+		{
+			lz.hdr[lz.header++] = c;
+			if (lz.header == LZSS_HEADER_SIZE)
+			{
+				if (memcmp(lz.hdr, LZSS_MAGIC, 4))
+				{
+					lz.error = 1;
+					return -1;
+				}
+				lz.remain = ((long)lz.hdr[4] << 24) | ((long)lz.hdr[5] << 16) | ((long)lz.hdr[6] << 8) | lz.hdr[7];
+			}
+			continue;
+		}
+
+		// 展開し終えた後はXMODEMの埋め草（0x1a）なので捨てる
+		if (lz.remain <= 0)
+			break;
+
+		// フラグの1バイト（8個分のデータの種類）
+		if (!(lz.flags & 0x100))
+		{
+			lz.flags = c | 0xff00;
+			continue;
+		}
+
+		if (lz.flags & 1)
+		{
+			// そのままの1バイト
+			if (lzss_put(c) < 0)
+				goto err;
+		}
+		else if (lz.first < 0)
+		{
+			// 参照の1バイト目（次のブロックにまたがることもある）
+			lz.first = c;
+			continue;
+		}
+		else
+		{
+			// 参照（距離は12ビット，長さは4ビット）
+			dist = ((lz.first << 4) | (c >> 4)) + 1;
+			len = (c & 0xf) + LZSS_THRESHOLD;
+			lz.first = -1;
+			while (len-- > 0 && lz.remain > 0)
+			{
+				if (lzss_put(lz.window[(lz.pos - dist) & LZSS_WINDOW_MASK]) < 0)
+					goto err;
+			}
+		}
+		// 次のフラグのビットへ（8個使い切ったら次はフラグの1バイト）
+		lz.flags >>= 1;
+	}
+
+	return 0;
+
+err:
+	lz.error = 1;
+	return -1;
+}
+
+// どこから？
+// 『bootload/main.c』の『main関数（loadコマンド）』
+// 展開の終了（窓に残っている分を渡す）
+int lzss_stream_end(void)
+{
+	if (lz.error || lz.header < LZSS_HEADER_SIZE || lz.remain > 0)
+		return -1;
+	return lzss_flush();
+}
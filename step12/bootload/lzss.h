@@ -0,0 +1,24 @@
+#ifndef _LZSS_H_INCLUDED_
+#define _LZSS_H_INCLUDED_
+
+/*
+	LZSSで圧縮したイメージの展開
+	形式（ホスト側の圧縮ツールは tools/lzss.c）
+		- 4バイト : マジックナンバ "KZLZ"
+		- 4バイト : 展開後のサイズ（ビッグエンディアン）
+		- 以降	  : フラグの1バイト（下位ビットから順に，1なら次はそのままの1バイト，
+					0なら次の2バイトが過去に出てきたデータの参照）とデータの繰り返し
+					参照は 距離-1 の12ビット（1〜4096バイト前）と 長さ-3 の4ビット（3〜18バイト）
+*/
+
+#define LZSS_MAGIC "KZLZ"
+#define LZSS_HEADER_SIZE 8
+
+// 展開に使う履歴（スライド窓）のサイズ．作業領域として用意すること
+#define LZSS_WINDOW_SIZE 4096
+
+void lzss_stream_start(char *window, int (*func)(char *buf, int size)); // 展開の開始（展開したデータはfuncに渡す）
+int lzss_stream_write(char *buf, int size);							   // 圧縮データの展開（エラーなら-1）
+int lzss_stream_end(void);											   // 展開の終了（サイズが足りなければ-1）
+
+#endif
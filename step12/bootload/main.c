@@ -5,6 +5,14 @@
 #include "xmodem.h"
 #include "lib.h"
 #include "elf.h"
+#include "lzss.h"
+#include "sload.h"
+#include "imgcrc.h"
+#include "dram.h"
+#include "timer.h"
+
+// DRAMが使えるか（使えなければ内蔵RAMのバッファにロードする）
+static int dram_ok = 0;
 
 static int init(void)
 {
@@ -39,56 +47,265 @@ static int init(void)
 	// OSがインタフェースを用意する = デバイスドライバを書く
 	serial_init(SERIAL_DEFAULT_DEVICE);
 
+	// タイムアウトや待ち合わせに使うタイマ（割込みは使わずにポーリングで数える）
+	timer_init();
+
+	// 外部DRAMの初期化（OSもこの設定のままDRAMを使う）
+	dram_init();
+	if (!dram_check())
+		dram_ok = 1;
+	else
+		puts("DRAM check failed. use internal RAM buffer.\n");
+
 	return 0;
 }
 
+// ダンプの1行に表示するバイト数
+#define DUMP_LINE_BYTES 16
+
+// ダンプの1行（アドレス，16進数，ASCII）を組み立ててから，まとめて出力する
+// 1バイトごとにputxval()とputs()を呼ぶよりも，関数呼び出しと変換の手間が少ない
+// 例) ffc020  23 69 66 6e 64 65 66 20  5f 44 45 46 49 4e 45 53  #ifndef _DEFINES
+static void dump_line(unsigned long addr, unsigned char *p, int n)
+{
+	char line[80];
+	char *q;
+	int i;
+
+	q = ultoxstr(addr, line, 6); // H8/3069Fのアドレスは24ビット
+	*(q++) = ' ';
+	for (i = 0; i < DUMP_LINE_BYTES; i++)
+	{
+		*(q++) = ' ';
+		if (i == 8)
+			*(q++) = ' '; // 8バイトごとに区切る
+		if (i < n)
+		{
+			q = ultoxstr(p[i], q, 2);
+		}
+		else
+		{
+			*(q++) = ' ';
+			*(q++) = ' ';
+		}
+	}
+	*(q++) = ' ';
+	*(q++) = ' ';
+	for (i = 0; i < n; i++)
+		*(q++) = (p[i] >= 0x20 && p[i] < 0x7f) ? p[i] : '.';
+	*(q++) = '\n';
+	*q = '\0';
+
+	puts(line);
+}
+
 // メモリの16進数ダンプ
 static int dump(char *buf, long size)
 {
-	long i;
-
 	if (size < 0)
 	{
 		puts("no data.\n");
 		return -1;
 	}
 
-	for (i = 0; i < size; i++)
+	for (; size > 0; buf += DUMP_LINE_BYTES, size -= DUMP_LINE_BYTES)
+		dump_line((unsigned long)buf, (unsigned char *)buf, (size > DUMP_LINE_BYTES) ? DUMP_LINE_BYTES : size);
+
+	return 0; // 正常に終了
+}
+
+// コマンドに続く16進数の引数をnum個取り出す（足りなければ-1）
+static int get_args(char *p, unsigned long *args, int num)
+{
+	char *end;
+	int i;
+
+	for (i = 0; i < num; i++)
+	{
+		while (*p == ' ')
+			p++;
+		args[i] = xtoul(p, &end);
+		if (end == p)
+			return -1;
+		p = end;
+	}
+
+	return 0;
+}
+
+// 1バイトの表示（peek, poke）．I/Oのレジスタも読めるようにvolatileで1回だけ読む
+static void peek(unsigned long addr)
+{
+	putxval(addr, 6);
+	puts(": ");
+	putxval(*(volatile unsigned char *)addr, 2);
+	puts("\n");
+}
+
+// 受信したデータの渡し先
+// 先頭がLZSSのマジックナンバなら展開してからELFのローダへ，そうでなければそのままELFのローダへ
+static int (*load_func)(char *buf, int size);
+
+// 受信バッファのサイズ（XMODEMの1ブロックとスライディングウィンドウの受信バッファの大きい方）
+#define LOAD_RECV_BUFFER_SIZE (SLOAD_WINDOW > XMODEM_BUFFER_SIZE ? SLOAD_WINDOW : XMODEM_BUFFER_SIZE)
+
+static int load_write(char *buf, int size)
+{
+	// 受信しながら，末尾のトレイラと照合するCRC-32を計算する（受信後にイメージを読み直さない）
+	imgcrc_write(buf, size);
+	if (!load_func)
+		load_func = memcmp(buf, LZSS_MAGIC, 4) ? elf_stream_write : lzss_stream_write;
+	return load_func(buf, size);
+}
+
+// どこから？
+// 『main関数（loadコマンド）』『autoboot関数』
+// ロードの開始（workは作業領域．先頭にELFのヘッダ，LZSSの展開用の窓，受信バッファの順に置く）
+static void load_start(char *work)
+{
+	// 受け取りながらセグメントを展開する（圧縮されていれば展開しながら）
+	elf_stream_start(work, ELF_STREAM_HEADER_SIZE + LZSS_WINDOW_SIZE + LOAD_RECV_BUFFER_SIZE, dram_ok);
+	lzss_stream_start(work + ELF_STREAM_HEADER_SIZE, elf_stream_write);
+	load_func = NULL;
+	imgcrc_start();
+}
+
+// ロードの終了．エントリーポイントを返す（エラーならメッセージを出してNULL）
+// sizeは受け取ったサイズ（受信エラーなら-1）
+static char *load_end(long size)
+{
+	char *entry_point;
+
+	if (load_func == lzss_stream_write && lzss_stream_end() < 0)
+		size = -1;
+	entry_point = (size < 0) ? NULL : elf_stream_end(); // ロードしてきたプログラムのエントリーポイントget
+
+	if (size < 0)
+	{
+		puts("\nreceive error!\n");
+	}
+	else if (!entry_point)
 	{
-		// 16進数文字を２個出力
-		// 1バイト出力
-		// buf[i] は　char 一個分，　charは１バイトなので，　char一個分は16進数文字２個分で正しい
-		// なのでbuf[i]で２と指定する
-		putxval(buf[i], 2);
-
-		// i % 16 と一緒
-		//                                                  ↓ この部分
-		// 23 69 66 6e 64 65 66 20  5f 44 45 46 49 4e 45 53
-		// 5f 48 5f 49 4e 43 4c 55  44 45 44 5f 0a 23 64 65
-		if ((i & 0xf) == 15)
+		puts("\nELF load error!\n");
+	}
+	// CRC-32が合わなければ，壊れたイメージなのでrunさせない
+	else if (imgcrc_end() == IMGCRC_ERROR)
+	{
+		entry_point = NULL;
+		puts("\nCRC error!\n");
+	}
+
+	return entry_point;
+}
+
+// ROMに埋め込んだイメージ（autoimg.S）を，ロードと同じ手順で展開する
+// 一度に渡すサイズ
+#define AUTOBOOT_CHUNK_SIZE 1024
+
+// どこから？
+// 『main関数』
+// リセット後にAUTOBOOT_WAIT_MSECミリ秒キー入力が無ければ，埋め込んだイメージを展開してエントリーポイントを返す
+// キー入力があったか，イメージが無いか壊れていればNULL（コマンド入力に進む）
+static char *autoboot(char *work)
+{
+	extern char autoboot_image, autoboot_image_end;
+	char *p = &autoboot_image;
+	long size = &autoboot_image_end - &autoboot_image;
+	char *entry_point;
+	int n;
+
+	if (!size)
+		return NULL;
+
+	puts("autoboot: press any key to stop.\n");
+	timer_start(TIMER_TIMEOUT, AUTOBOOT_WAIT_MSEC);
+	while (!timer_is_expired(TIMER_TIMEOUT))
+	{
+		if (serial_is_recv_enable(SERIAL_DEFAULT_DEVICE))
 		{
-			puts("\n");
+			serial_recv_byte(SERIAL_DEFAULT_DEVICE);
+			puts("autoboot stopped.\n");
+			return NULL;
 		}
-		else
+	}
+
+	load_start(work);
+	for (; p < &autoboot_image_end; p += n)
+	{
+		n = (&autoboot_image_end - p > AUTOBOOT_CHUNK_SIZE) ? AUTOBOOT_CHUNK_SIZE : (&autoboot_image_end - p);
+		if (load_write(p, n) < 0)
 		{
-			// i % 16と一緒
-			//                         ↓ この部分
-			// 23 69 66 6e 64 65 66 20  5f 44 45 46 49 4e 45 53
-			if ((i & 0xf) == 7)
-				puts(" ");
-			puts(" ");
+			size = -1;
+			break;
 		}
 	}
-	puts("\n");
+	entry_point = load_end(size);
 
-	return 0; // 正常に終了
+	// 無人で起動するので，トレイラの無い（検査できない）イメージは起動しない
+	if (entry_point && imgcrc_end() != IMGCRC_OK)
+	{
+		entry_point = NULL;
+		puts("autoboot: no CRC trailer.\n");
+	}
+
+	return entry_point;
+}
+
+// 通信速度の切り替え（speedコマンド）
+// 切り替えた後，新しい速度で改行が届けば確定し，届かなければ元の速度に戻す
+// （端末側が切り替えられなかったり，その速度で通信できない時に，コンソールを失わないように）
+// OSはserial_initで9600bpsに戻すので，runの前にspeed 9600で戻しておくこと（tools/ksendの-sは自動で戻す）
+#define SPEED_CONFIRM_MSEC 5000 // 改行を待つ時間
+
+static unsigned long speed_bps = 9600; // serial_initで設定した速度
+
+static int speed(unsigned long bps)
+{
+	int err;
+	unsigned char c;
+
+	// このメッセージは元の速度で送り切ってから切り替わる
+	puts("speed: press enter at the new speed.\n");
+	if (serial_set_baud(SERIAL_DEFAULT_DEVICE, bps, &err) < 0)
+	{
+		puts("unsupported speed.\n");
+		return -1;
+	}
+
+	// 切り替えの前後に届いた文字は化けているので捨てる
+	timer_wait(10);
+	while (serial_is_recv_enable(SERIAL_DEFAULT_DEVICE))
+		serial_recv_byte(SERIAL_DEFAULT_DEVICE);
+	serial_clear_error(SERIAL_DEFAULT_DEVICE);
+
+	timer_start(TIMER_TIMEOUT, SPEED_CONFIRM_MSEC);
+	while (!timer_is_expired(TIMER_TIMEOUT))
+	{
+		// フレーミングエラーなどが出た文字は，速度が合っていないので数えない
+		if (serial_clear_error(SERIAL_DEFAULT_DEVICE))
+			continue;
+		if (!serial_is_recv_enable(SERIAL_DEFAULT_DEVICE))
+			continue;
+		c = serial_recv_byte(SERIAL_DEFAULT_DEVICE);
+		if (c == '\r' || c == '\n')
+		{
+			speed_bps = bps;
+			puts("speed ok.\n");
+			return 0;
+		}
+	}
+
+	serial_set_baud(SERIAL_DEFAULT_DEVICE, speed_bps, NULL);
+	puts("speed change failed.\n");
+	return -1;
 }
 
+// 転送アプリが終了するまでの待ち合わせ（ミリ秒）
+#define LOAD_WAIT_MSEC 300
+
 static void wait()
 {
-	volatile long i;
-	for (i = 0; i < 300000; i++)
-		;
+	timer_wait(LOAD_WAIT_MSEC);
 }
 
 int global_data = 0x10;		   // -> .data
@@ -119,64 +336,140 @@ static void printval(void)
 // 『bootload/startup.s』の『_start関数』
 int main(void)
 {
-	static char buf[16];
+	static char buf[32];
+	unsigned long args[2];
 	static long size = -1;
 	static unsigned char *loadbuf = NULL;
 	// リンカスクリプトで定義されているバッファ
 	// バッファ領域を指すシンボル
-	// ロードされてここに入れたプログラムは，,後でRAM上にELF形式のセグメントの指示する通りに展開されて実行される
-	// -> なのでこれは一時的に置いておくにすぎない
-	// 普通はRAMの先頭からプログラムを始めるものだから，　ロードは後ろの方に入れておく
+	// 受信したプログラムは，ブロックを受信するたびにELF形式のセグメントの指示する通りに展開される
+	// -> ここにはXMODEMの1ブロックとELFのヘッダだけを置く（ファイル全体は溜めない）
+	// 普通はRAMの先頭からプログラムを始めるものだから，　作業領域は後ろの方に置いておく
 	extern int buffer_start;
+	// DRAMが使えれば，作業領域はDRAMの先頭に置く（内蔵RAMはすべてロード先に使える）
+	// OSはDRAMの領域をヒープとして使うが，展開が終わった後なので上書きされても問題ない
+	extern int dramarea;
 
 	// 割込み無効化のインラインアセンブリを呼ぶ
 	// 最初の初期化処理は，割込み無効の状態で行う
 	// 一応H８のリセット処理は，最初に割込み無効の状態にしてくれているが，念のためにしておく
 	INTR_DISABLE;
 
-	char *entry_point;
+	char *entry_point = NULL;
 	void (*f)(void); // 関数へのポインタ
 
 	// initした後にグローバル変数は使える
 	init();
 
+	// 作業領域（DRAMが使えればDRAMの先頭，使えなければ内蔵RAMのバッファ）
+	loadbuf = dram_ok ? (char *)(&dramarea) : (char *)(&buffer_start);
+
+	// 埋め込んだイメージがあれば，キー入力が無い限りそのまま起動する
+	entry_point = autoboot(loadbuf);
+	if (entry_point)
+	{
+		size = 0; // dumpで展開済みのELFのヘッダを表示できるように
+		puts("starting from entry point: ");
+		putxval((unsigned long)entry_point, 0);
+		puts("\n");
+		f = (void (*)(void))entry_point;
+		f();
+	}
+
 	for (;;)
 	{
 		puts("kzload> ");
 		// 端末変換した結果をbufに格納
 		gets(buf);
 
-		// load
-		if (!strcmp(buf, "load"))
+		// load（XMODEM）, sload（スライディングウィンドウ．ホストからはtools/ksendで送る）
+		if (!strcmp(buf, "load") || !strcmp(buf, "sload"))
 		{
-			// ロードする場所
-			loadbuf = (char *)(&buffer_start);
-
-			size = xmodem_recv(loadbuf);
+			load_start(loadbuf);
+			if (buf[0] == 's')
+				size = sload_recv(loadbuf + ELF_STREAM_HEADER_SIZE + LZSS_WINDOW_SIZE, load_write);
+			else
+				size = xmodem_recv(loadbuf + ELF_STREAM_HEADER_SIZE + LZSS_WINDOW_SIZE, load_write);
 			// 転送アプリ(xmodem)が終了し， mainに処理が戻るまで待ち合わせる．
 			wait();
 
-			if (size < 0)
+			entry_point = load_end(size);
+			if (entry_point)
+			{
+				puts("\nreceive succeeded.\n");
+				// トレイラの無いイメージはそのままrunできる（検査はしていない）
+				if (imgcrc_end() == IMGCRC_NONE)
+					puts("no CRC trailer.\n");
+			}
+		}
+		// speed（例: speed 57600．20MHzでは76800bpsが上限で，115200bpsは誤差が大きく設定できない）
+		else if (!strncmp(buf, "speed ", 6))
+		{
+			speed(atoul(buf + 6));
+		}
+		// dump アドレス サイズ（16進数．例: dump ffc020 100）
+		else if (!strncmp(buf, "dump ", 5))
+		{
+			if (get_args(buf + 5, args, 2) < 0)
+				puts("usage: dump addr len\n");
+			else
+				dump((char *)args[0], args[1]);
+		}
+		// peek アドレス（1バイト読む）
+		else if (!strncmp(buf, "peek ", 5))
+		{
+			if (get_args(buf + 5, args, 1) < 0)
+				puts("usage: peek addr\n");
+			else
+				peek(args[0]);
+		}
+		// poke アドレス 値（1バイト書いて，読み直して表示する）
+		else if (!strncmp(buf, "poke ", 5))
+		{
+			if (get_args(buf + 5, args, 2) < 0)
+			{
+				puts("usage: poke addr value\n");
+			}
+			else
+			{
+				*(volatile unsigned char *)args[0] = args[1];
+				peek(args[0]);
+			}
+		}
+		// xdump アドレス サイズ（メモリの内容をXMODEMでホストに送る．ホスト側で受信を始める）
+		else if (!strncmp(buf, "xdump ", 6))
+		{
+			if (get_args(buf + 6, args, 2) < 0)
 			{
-				puts("\nXMODEM receive error!\n");
+				puts("usage: xdump addr len\n");
 			}
 			else
 			{
-				puts("\nXMODEM receive succeeded.\n");
+				puts("xdump: start XMODEM receive on the host.\n");
+				if (xmodem_send((char *)args[0], args[1]) < 0)
+				{
+					wait();
+					puts("\nsend error!\n");
+				}
+				else
+				{
+					wait();
+					puts("\nsend succeeded.\n");
+				}
 			}
 		}
-		// dump
+		// dump（ファイル全体は残っていないので，取っておいたELFのヘッダを表示する）
 		else if (!strcmp(buf, "dump"))
 		{
 			puts("size: ");
 			putxval(size, 0); // 1でも良い気がする．．また実験しよう
 			puts("\n");
-			dump(loadbuf, size);
+			dump(loadbuf, (size < 0) ? size : elf_stream_header_size());
 		}
 		// run (ELF形式ファイルの実行)
 		else if (!strcmp(buf, "run"))
 		{
-			entry_point = elf_load(loadbuf); // ロードしてきたプログラムのエントリーポイントget
+			// セグメントはloadの時に展開済み
 			if (!entry_point)				 // ここではアドレス自体に興味がある．アドレスの先のプログラムはこの後実行される処理がある
 			{
 				puts("run error!\n");
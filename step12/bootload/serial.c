@@ -33,11 +33,27 @@
 
 #include "defines.h"
 #include "serial.h"
+#include "lib.h"
+#include "timer.h"
 
 // ハードウェア制御などに利用される目的の"周辺コントローラなどを内蔵しているCPU"を「マイクロコントローラ」と呼ぶ
 // SCIの数 (SCI=シリアルコントローラ)
 #define SERIAL_SCI_NUM 3
 
+// ボーレートの誤差の許容値（千分率）
+// 調歩同期式では送受信側の誤差の合計が5%程度を超えると受信できなくなるので，片側4%までにしておく
+#define SERIAL_BAUD_ERROR_MAX 40
+/*
+	CPU_CLOCK = 20MHzの時の主な速度（CKS = 0）
+		   9600: BRR = 64  →   9615bps（+0.2%）
+		  19200: BRR = 32  →  18939bps（-1.4%）
+		  38400: BRR = 15  →  39063bps（+1.7%）
+		  57600: BRR = 10  →  56818bps（-1.4%）
+		  76800: BRR =  7  →  78125bps（+1.7%）
+		 115200: BRR =  4  → 125000bps（+8.5%） ← 許容値を超えるので設定できない
+	20MHzでは76800bps（標準的な速度では57600bps）が上限．115200bpsは25MHz（BRR = 6, -3.1%）なら使える
+*/
+
 // SCIの定義
 // 先頭アドレス
 // 構造体でキャスト，　0xffffb0というアドレスをh8_3069f_sciという構造体でキャスト -> メモリマップドIOで周辺コントローラのアドレス経由でアクセスするとき，　アドレスを構造体に無理やりキャストして入れて，操る
@@ -135,6 +151,66 @@ int serial_init(int index)
 	return 0;
 }
 
+// ボーレートの設定
+/*
+	調歩同期式モードでは，1ビットの時間がクロック 32 × 4^CKS × (BRR + 1) 個分になる
+		BRR = CPU_CLOCK / (32 × 4^CKS × bps) - 1
+	BRRは8ビットなので，収まるようにCKS（SMRのクロックセレクト，0〜3）を小さい方から選ぶ．
+	割り切れない分は誤差になる．誤差を千分率（符号付き）で*errpに返す（errpはNULLでもよい）
+	誤差が大きすぎて通信できない速度，BRRに収まらない速度なら設定せずに-1を返す
+*/
+int serial_set_baud(int index, unsigned long bps, int *errp)
+{
+	volatile struct h8_3069f_sci *sci = regs[index].sci;
+	unsigned long div, n, actual, diff;
+	int cks, err;
+	uint8 scr;
+
+	if (!bps)
+		return -1;
+
+	for (cks = 0; cks < 4; cks++)
+	{
+		// 掛け算はlibgccになるので，4^CKSと32はシフトで
+		div = bps << (5 + (cks << 1));
+		// 四捨五入で一番近いBRR + 1を求める
+		n = udivmod(CPU_CLOCK + (div >> 1), div, NULL);
+		if (n >= 1 && n <= 256)
+			break;
+	}
+	if (cks == 4)
+		return -1;
+
+	// 実際の速度と誤差（×1000もシフトで）
+	actual = udivmod(CPU_CLOCK, n << (5 + (cks << 1)), NULL);
+	diff = (actual > bps) ? actual - bps : bps - actual;
+	err = udivmod((diff << 10) - (diff << 4) - (diff << 3), bps, NULL);
+	if (actual < bps)
+		err = -err;
+	if (errp)
+		*errp = err;
+	if (err > SERIAL_BAUD_ERROR_MAX || err < -SERIAL_BAUD_ERROR_MAX)
+		return -1;
+
+	// 送信中の文字を送り切ってから切り替える
+	if (sci->scr & H8_3069F_SCI_SCR_TE)
+	{
+		while (!(sci->ssr & H8_3069F_SCI_SSR_TEND))
+			;
+	}
+
+	// 送受信を止めてから設定し，1ビット分以上待ってから元に戻す（割込みの設定もそのまま戻る）
+	scr = sci->scr;
+	sci->scr = 0;
+	sci->smr = (sci->smr & ~H8_3069F_SCI_SMR_CKS_PER64) | cks;
+	sci->brr = n - 1;
+	// 1ビットの時間（1000 / bpsミリ秒，切り上げ）をタイマで待つ（speedコマンドから呼ばれるので，timer_init()は済んでいる）
+	timer_wait(udivmod(1000 + bps - 1, bps, NULL));
+	sci->scr = scr;
+
+	return 0;
+}
+
 // 受信準備OK?
 int serial_is_send_enable(int index)
 {
@@ -180,6 +256,21 @@ int serial_is_recv_enable(int index)
 	return (sci->ssr & H8_3069F_SCI_SSR_RDRF);
 }
 
+// 受信エラー（オーバーラン・フレーミングエラー・パリティエラー）のフラグを落とす
+// エラーのフラグが立ったままだと，以降の受信ができない
+// 落としたフラグ（SSRのエラービット）を返す
+int serial_clear_error(int index)
+{
+	volatile struct h8_3069f_sci *sci = regs[index].sci;
+	int err;
+
+	err = sci->ssr & (H8_3069F_SCI_SSR_ORER | H8_3069F_SCI_SSR_FERERS | H8_3069F_SCI_SSR_PER);
+	if (err)
+		sci->ssr &= ~err;
+
+	return err;
+}
+
 // 1文字受信
 unsigned char serial_recv_byte(int index)
 {
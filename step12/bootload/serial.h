@@ -4,9 +4,11 @@
 #define _SERIAL_H_INCLUDED_
 
 int serial_init(int index);						  // デバイス初期化
+int serial_set_baud(int index, unsigned long bps, int *errp); // ボーレートの設定（誤差を千分率で返す）
 int serial_is_send_enable(int index);			  // 送信可能か？
 int serial_send_byte(int index, unsigned char b); // 1文字送信
 int serial_is_recv_enable(int index);			  // 受信可能か？
 unsigned char serial_recv_byte(int index);		  // 1文字受信
+int serial_clear_error(int index);				  // 受信エラーのクリア（落としたエラーのビットを返す）
 
 #endif
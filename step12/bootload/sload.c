@@ -0,0 +1,308 @@
+// スライディングウィンドウでのファイルの受信
+
+#include "defines.h"
+#include "serial.h"
+#include "lib.h"
+#include "crc32.h"
+#include "timer.h"
+#include "sload.h"
+
+/*
+	受信は割込みを使わずにポーリングで行う（ブートローダでは割込みスタックが通常のスタックと重なっているため）
+	受信したデータの処理（ELFのセグメントへの書き込みや展開）をしている間も次のフレームが届き続けるので，
+	ループの中で，受信した文字があれば最優先で受け取り，無い時に少しずつ処理を進める
+	（一度に処理する量はSLOAD_SLICEバイトまで．1文字を受信する時間の間に終わる量にする）
+	もしオーバーランしてしまっても，そのフレームのCRCが合わないだけなので，送り直してもらえば済む
+*/
+
+#define SLOAD_SYNC0 0xaa
+#define SLOAD_SYNC1 0x55
+#define SLOAD_READY 'W'
+#define SLOAD_ACK 'A'
+#define SLOAD_RESUME 'R'
+#define SLOAD_END 'E'
+#define SLOAD_CAN 0x18
+
+#define SLOAD_MASK (SLOAD_WINDOW - 1)
+#define SLOAD_HEADER_SIZE 6 // 位置と長さ
+#define SLOAD_SLICE 16		// 受信の合間に一度に処理するバイト数
+#define SLOAD_ACK_INTERVAL (SLOAD_WINDOW >> 2) // これだけ処理したらACKを返す
+#define SLOAD_READY_INTERVAL 1000 // 受信が始まるまで'W'を送る間隔（ミリ秒）
+#define SLOAD_TIMEOUT 10000		  // 受信が始まった後，これだけ何も届かなければ中断する（ミリ秒）
+
+// フレームの受信の状態
+enum
+{
+	SLOAD_STATE_SYNC0,
+	SLOAD_STATE_SYNC1,
+	SLOAD_STATE_HEADER,
+	SLOAD_STATE_DATA,
+	SLOAD_STATE_CRC,
+};
+
+static struct
+{
+	char *buf;
+	int state;
+	unsigned char header[SLOAD_HEADER_SIZE + 4]; // 位置と長さ，CRC-32
+	unsigned int count;							 // 受信したヘッダ・データ・CRCのバイト数
+	long offset;								 // 受信中のフレームの位置
+	unsigned int len;							 // 受信中のフレームの長さ（intは16ビットなので，0x8000以上で負にならないように符号無し）
+	int store;									 // 受信中のフレームを受信バッファに入れるか
+	unsigned int skip;							 // 受信中のフレームの先頭の，受信済みで捨てるバイト数
+	int dup;									 // 受信中のフレームはすべて受信済み（送り直しの重複）
+	uint32 crc;
+	long expected;		  // 次に受け取るべきファイル中の位置（ここまでは受信バッファに入れた）
+	long done;			  // funcに渡し終えたファイル中の位置
+	long acked;			  // 最後にACKを返した位置
+	unsigned int head;	  // 受信バッファの読み出し位置
+	unsigned int tail;	  // 受信バッファの書き込み位置
+	int resume;			  // 送り直しを頼んで，まだ届いていない
+	int end;			  // ファイルの終わりのフレームを受け取った
+	unsigned char tx[16]; // 送信待ちの文字（受信を止めないように，送信可能な時に1文字ずつ送る）
+	int txhead;
+	int txlen;
+} sl;
+
+// 送信待ちに1文字入れる
+static void sload_put(unsigned char c)
+{
+	sl.tx[(sl.txhead + sl.txlen++) & 0xf] = c;
+}
+
+// 送信待ちに応答（種類と位置）を入れる（受信ループの中で1文字ずつ送る）
+static void sload_reply(int c, long offset)
+{
+	int i;
+
+	if (sl.txlen + 5 > sizeof(sl.tx))
+		return; // 一杯なら諦める（送信側はタイムアウトで送り直す）
+	sload_put(c);
+	for (i = 24; i >= 0; i -= 8)
+		sload_put(offset >> i);
+}
+
+// エラーがあったので送り直してもらう（頼んだ位置のフレームが届くまでは繰り返し頼まない）
+static void sload_resume(void)
+{
+	if (!sl.resume)
+	{
+		sl.resume = 1;
+		sload_reply(SLOAD_RESUME, sl.expected);
+	}
+}
+
+// フレームのヘッダを受け取った
+static void sload_header(void)
+{
+	sl.offset = ((long)sl.header[0] << 24) | ((long)sl.header[1] << 16) | ((long)sl.header[2] << 8) | sl.header[3];
+	sl.len = ((unsigned int)sl.header[4] << 8) | sl.header[5];
+	sl.count = 0;
+
+	// 壊れたヘッダ（同期を取り直す）
+	if (sl.len > SLOAD_FRAME_MAX)
+	{
+		sl.state = SLOAD_STATE_SYNC0;
+		sload_resume();
+		return;
+	}
+
+	// 待っている位置を含むフレームで，受信バッファに空きがあれば受け取る
+	// 送信側はACKされた位置から送り直すので，フレームの区切りが待っている位置と揃うとは限らない
+	// -> 待っている位置より手前の部分（受信済み）は読み捨てて，残りだけ受け取る
+	// 先の位置なら途中のフレームが抜けたので送り直してもらう
+	sl.skip = 0;
+	sl.dup = 0;
+	sl.store = 0;
+	if (sl.offset > sl.expected)
+	{
+		sload_resume();
+	}
+	else if (sl.offset + sl.len <= sl.expected && (sl.len || sl.offset < sl.expected))
+	{
+		// すべて受信済み．ACKが失われて送信側が古い位置から送り直しているので，CRCが合えばACKを返し直す
+		sl.dup = 1;
+	}
+	else
+	{
+		sl.skip = sl.expected - sl.offset;
+		sl.store = (sl.len - sl.skip <= SLOAD_WINDOW - (sl.tail - sl.head));
+	}
+	sl.state = sl.len ? SLOAD_STATE_DATA : SLOAD_STATE_CRC;
+}
+
+// フレームのCRC-32を受け取った
+static void sload_frame(void)
+{
+	uint32 crc;
+
+	crc = ((uint32)sl.header[6] << 24) | ((uint32)sl.header[7] << 16) | ((uint32)sl.header[8] << 8) | sl.header[9];
+	sl.state = SLOAD_STATE_SYNC0;
+
+	if (crc32_final(sl.crc) != crc)
+	{
+		sload_resume();
+		return;
+	}
+	// 送信側が知っている処理済みの位置を更新してもらう（古い位置からの送り直しを止める）
+	if (sl.dup)
+	{
+		sload_reply(SLOAD_ACK, sl.done);
+		return;
+	}
+	if (!sl.store)
+		return;
+
+	// 受け取ったデータを確定する
+	sl.tail += sl.len - sl.skip;
+	sl.expected += sl.len - sl.skip;
+	sl.resume = 0;
+	// ファイルの終わり（送信側はこの応答を受けたら終了する）
+	if (!sl.len)
+	{
+		sl.end = 1;
+		sload_reply(SLOAD_END, sl.expected);
+	}
+}
+
+// 受信した1文字の処理
+static void sload_input(unsigned char c)
+{
+	switch (sl.state)
+	{
+	case SLOAD_STATE_SYNC0:
+		if (c == SLOAD_SYNC0)
+			sl.state = SLOAD_STATE_SYNC1;
+		break;
+	case SLOAD_STATE_SYNC1:
+		if (c == SLOAD_SYNC1)
+		{
+			sl.state = SLOAD_STATE_HEADER;
+			sl.count = 0;
+			sl.crc = CRC32_INIT;
+		}
+		else if (c != SLOAD_SYNC0)
+		{
+			sl.state = SLOAD_STATE_SYNC0;
+		}
+		break;
+	case SLOAD_STATE_HEADER:
+		sl.header[sl.count++] = c;
+		sl.crc = CRC32_BYTE(sl.crc, c);
+		if (sl.count == SLOAD_HEADER_SIZE)
+			sload_header();
+		break;
+	case SLOAD_STATE_DATA:
+		// 確定するまでは受信バッファの書き込み位置は進めない（CRCが合わなければ無かったことにする）
+		if (sl.store && sl.count >= sl.skip)
+			sl.buf[(sl.tail + sl.count - sl.skip) & SLOAD_MASK] = c;
+		sl.crc = CRC32_BYTE(sl.crc, c);
+		if (++sl.count == sl.len)
+		{
+			sl.state = SLOAD_STATE_CRC;
+			sl.count = 0;
+		}
+		break;
+	case SLOAD_STATE_CRC:
+		sl.header[SLOAD_HEADER_SIZE + sl.count++] = c;
+		if (sl.count == 4)
+			sload_frame();
+		break;
+	}
+}
+
+// 溜まっているデータを少しだけfuncに渡す
+static int sload_process(int (*func)(char *buf, int size))
+{
+	unsigned int pos = sl.head & SLOAD_MASK;
+	int len = sl.tail - sl.head;
+
+	if (len > SLOAD_SLICE)
+		len = SLOAD_SLICE;
+	if (len > SLOAD_WINDOW - pos)
+		len = SLOAD_WINDOW - pos;
+	if (func(sl.buf + pos, len) < 0)
+		return -1;
+	sl.head += len;
+	sl.done += len;
+
+	// ある程度進んだか，溜まっていた分を処理し終えたらACKを返す（送信側はその分だけ先に送れる）
+	if (sl.done - sl.acked >= SLOAD_ACK_INTERVAL || sl.head == sl.tail)
+	{
+		sl.acked = sl.done;
+		sload_reply(SLOAD_ACK, sl.done);
+	}
+
+	return 0;
+}
+
+// どこから？
+// 『bootload/main.c』の『main関数（sloadコマンド）』
+// ファイルの受信．受信したサイズを返す（エラーなら-1）
+long sload_recv(char *buf, int (*func)(char *buf, int size))
+{
+	memset(&sl, 0, sizeof(sl));
+	sl.buf = buf;
+	sl.state = SLOAD_STATE_SYNC0;
+	timer_start(TIMER_INTERVAL, 0);
+
+	for (;;)
+	{
+		// 受信エラー（オーバーランなど）なら，受信中のフレームは捨てて送り直してもらう
+		if (serial_clear_error(SERIAL_DEFAULT_DEVICE))
+		{
+			sl.state = SLOAD_STATE_SYNC0;
+			sload_resume();
+		}
+
+		// 受信した文字があれば最優先で受け取る
+		if (serial_is_recv_enable(SERIAL_DEFAULT_DEVICE))
+		{
+			sload_input(serial_recv_byte(SERIAL_DEFAULT_DEVICE));
+			timer_start(TIMER_TIMEOUT, SLOAD_TIMEOUT);
+			continue;
+		}
+
+		// ACKなどを1文字ずつ送る
+		if (sl.txlen && serial_is_send_enable(SERIAL_DEFAULT_DEVICE))
+		{
+			serial_send_byte(SERIAL_DEFAULT_DEVICE, sl.tx[sl.txhead]);
+			sl.txhead = (sl.txhead + 1) & 0xf;
+			sl.txlen--;
+			continue;
+		}
+
+		// 受信したデータを少しずつ処理する
+		if (sl.head != sl.tail)
+		{
+			if (sload_process(func) < 0)
+			{
+				serial_send_byte(SERIAL_DEFAULT_DEVICE, SLOAD_CAN);
+				serial_send_byte(SERIAL_DEFAULT_DEVICE, SLOAD_CAN);
+				return -1;
+			}
+			continue;
+		}
+
+		// ファイルの終わりまで処理し，最後のACKも送り終えた
+		if (sl.end && !sl.txlen)
+			break;
+
+		// 受信が始まるまで，準備ができたことを定期的に知らせる
+		if (!sl.expected)
+		{
+			if (!sl.txlen && timer_is_expired(TIMER_INTERVAL))
+			{
+				timer_start(TIMER_INTERVAL, SLOAD_READY_INTERVAL);
+				sload_put(SLOAD_READY);
+			}
+		}
+		// 受信が始まった後に送信側がいなくなったら中断する
+		else if (timer_is_expired(TIMER_TIMEOUT))
+		{
+			return -1;
+		}
+	}
+
+	return sl.expected;
+}
@@ -0,0 +1,30 @@
+#ifndef _SLOAD_H_INCLUDED_
+#define _SLOAD_H_INCLUDED_
+
+/*
+	スライディングウィンドウでのファイルの受信（ホスト側の送信ツールは tools/ksend.c）
+	XMODEMはブロックごとにACKを待つので，その往復の間は回線が空いてしまう
+	こちらは送信側がACKを待たずにウィンドウの分まで続けて送り，受信側は処理し終えた位置をACKで返す
+	エラーの時は最初からではなく，最後に正しく受信できた位置から送り直してもらう
+
+	送信側 -> 受信側（フレーム）
+		0xaa 0x55			同期
+		位置 4バイト		ファイル中の位置（ビッグエンディアン）
+		長さ 2バイト		データのバイト数（最大SLOAD_FRAME_MAX．0ならファイルの終わり．'E'が返るまで繰り返し送る）
+		データ
+		CRC-32 4バイト		位置からデータまでのCRC-32（ビッグエンディアン）
+	受信側 -> 送信側
+		'W'					受信の準備ができた（受信が始まるまで定期的に送る）
+		'A' 位置4バイト		その位置の手前まで処理した（送信側はここからウィンドウの分まで送ってよい）
+		'R' 位置4バイト		エラーがあったので，その位置から送り直してほしい
+		'E' 位置4バイト		ファイルの終わりのフレームを受け取った（位置はファイルのサイズ）
+		CAN CAN				中断
+*/
+
+#define SLOAD_FRAME_MAX 256 // 1フレームのデータの最大サイズ（エラーの時に送り直す量が少なくなるように小さめ）
+#define SLOAD_WINDOW 2048	// ACKを待たずに送ってよいバイト数（受信バッファのサイズ）
+
+// 受信したデータはfuncに渡す（-1を返したら中断する）．bufはSLOAD_WINDOWバイトの受信バッファ
+long sload_recv(char *buf, int (*func)(char *buf, int size));
+
+#endif
@@ -0,0 +1,86 @@
+// 8ビットタイマ用のデバイスドライバの本体（ブートローダ用）
+
+/*
+	ブートローダは割込みを使えないので（割込みスタックが通常のスタックと重なっている），
+	TMR0をφ/8192でフリーランさせておき，TCNTの進んだ分をポーリングで数える
+		- 1カウントは約0.41ミリ秒（20MHz）．TCNTは8ビットなので約104ミリ秒で一周する
+		- 一周する前に読まないと一周分を数え損ねるが，タイムアウトが長くなる方にずれるだけ
+	ループの回数で待つのと違って，クロックやコンパイラの出力によって時間が変わらない
+*/
+
+#include "defines.h"
+#include "timer.h"
+
+#define H8_3069F_TMR01 ((volatile struct h8_3069f_tmr *)0xffff80)
+
+// TMR0とTMR1のレジスタは交互に並んでいる（[0]がTMR0）
+struct h8_3069f_tmr
+{
+	volatile uint8 tcr[2];	 // タイマコントロール
+	volatile uint8 tcsr[2];	 // タイマコントロール/ステータス
+	volatile uint8 tcora[2]; // タイムコンスタントA
+	volatile uint8 tcorb[2]; // タイムコンスタントB
+	volatile uint8 tcnt[2];	 // タイマカウンタ
+};
+
+// TCRの各ビットの定義
+#define H8_3069F_TMR_TCR_CKS_8192 (3 << 0) // クロック φ/8192（カウンタクリア無し，割込み無し）
+
+// ミリ秒をカウント数に変換する係数（1024倍しておき，掛けた後で10ビットシフトする．20MHzで2500）
+#define TIMER_MSEC_SCALE ((CPU_CLOCK / 8192 * 1024 + 500) / 1000)
+
+static struct
+{
+	unsigned char last;		// 最後に読んだTCNT
+	long remain[TIMER_NUM]; // 満了までの残りカウント数
+} tm;
+
+// TCNTの進んだ分だけ，動作中のタイマの残りを減らす
+static void timer_update(void)
+{
+	unsigned char now = H8_3069F_TMR01->tcnt[0];
+	unsigned char elapsed = now - tm.last;
+	int i;
+
+	tm.last = now;
+	for (i = 0; i < TIMER_NUM; i++)
+	{
+		if (tm.remain[i] > elapsed)
+			tm.remain[i] -= elapsed;
+		else
+			tm.remain[i] = 0;
+	}
+}
+
+// どこから？
+// 『bootload/main.c』の『init関数』
+void timer_init(void)
+{
+	volatile struct h8_3069f_tmr *tmr = H8_3069F_TMR01;
+
+	tmr->tcr[0] = 0;
+	tmr->tcsr[0] = 0;
+	tmr->tcnt[0] = 0;
+	tmr->tcr[0] = H8_3069F_TMR_TCR_CKS_8192;
+	tm.last = 0;
+}
+
+void timer_start(int index, unsigned int msec)
+{
+	timer_update();
+	// 16ビット同士の掛け算なので，ライブラリ関数を使わずにmulxu.wで済む
+	tm.remain[index] = ((unsigned long)msec * TIMER_MSEC_SCALE >> 10) + 1;
+}
+
+int timer_is_expired(int index)
+{
+	timer_update();
+	return tm.remain[index] ? 0 : 1;
+}
+
+void timer_wait(unsigned int msec)
+{
+	timer_start(TIMER_TIMEOUT, msec);
+	while (!timer_is_expired(TIMER_TIMEOUT))
+		;
+}
@@ -0,0 +1,16 @@
+// 8ビットタイマ用のデバイスドライバのヘッダファイル（ブートローダ用．割込みは使わない）
+
+#ifndef _TIMER_H_INCLUDED_
+#define _TIMER_H_INCLUDED_
+
+// ソフトウェアで数えるタイマの数（ハードウェアはTMR0を1つだけ使う）
+#define TIMER_NUM 2
+#define TIMER_INTERVAL 0 // NAKや'W'などを定期的に送る間隔
+#define TIMER_TIMEOUT 1	 // 受信のタイムアウト
+
+void timer_init(void);							// TMR0をフリーランで動かす
+void timer_start(int index, unsigned int msec); // タイマの開始（動作中なら最初から数え直す）
+int timer_is_expired(int index);				// 満了したか？（止まっているタイマも満了とみなす）
+void timer_wait(unsigned int msec);				// 指定した時間だけ待つ
+
+#endif
@@ -36,7 +36,12 @@
 extern void start(void);		// スタートアップ
 extern void intr_softerr(void); // ソフトウェアエラー（トラップ割込み）
 extern void intr_syscall(void); // システムコール（トラップ割込み）
-extern void intr_serintr(void); // シリアル割込み
+// 周辺機能の割込み（ベクタごとに入口を分けている．実体はintr.S）
+extern void intr_cmia0(void), intr_cmia1(void), intr_cmia2(void), intr_cmia3(void); // 8ビットタイマ（コンペアマッチA）
+extern void intr_dend0a(void);											  // DMAC（チャネル0Aの転送終了）
+extern void intr_eri0(void), intr_rxi0(void), intr_txi0(void), intr_tei0(void); // SCI0
+extern void intr_eri1(void), intr_rxi1(void), intr_txi1(void), intr_tei1(void); // SCI1
+extern void intr_eri2(void), intr_rxi2(void), intr_txi2(void), intr_tei2(void); // SCI2
 
 // vectors[]の内容は0x000000 - 0x0000ffにないといけない
 // リンカスクリプトの定義で先頭番地に配置する
@@ -84,10 +89,15 @@ void (*vectors[])(void) = {
 	NULL,
 	NULL,
 	NULL,
+	intr_cmia0, // 8ビットタイマ TMR0のコンペアマッチA（CMIA0）
 	NULL,
+	intr_cmia1, // 8ビットタイマ TMR1のコンペアマッチA（CMIA1）
 	NULL,
+	intr_cmia2, // 8ビットタイマ TMR2のコンペアマッチA（CMIA2）
 	NULL,
+	intr_cmia3, // 8ビットタイマ TMR3のコンペアマッチA（CMIA3）
 	NULL,
+	intr_dend0a, // DMAC チャネル0Aの転送終了（DEND0A）
 	NULL,
 	NULL,
 	NULL,
@@ -95,23 +105,19 @@ void (*vectors[])(void) = {
 	NULL,
 	NULL,
 	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-	intr_serintr, // シリアル関連の割り込みが発生したら，intr_serintr()という関数が呼ばれる -> 実体はintr.Sにある
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
-	intr_serintr,
+	intr_eri0, // シリアル関連の割り込みが発生したら，要因ごとの入口（intr_eri0()など）が呼ばれる -> 実体はintr.Sにある
+	intr_rxi0,
+	intr_txi0,
+	intr_tei0,
+	intr_eri1,
+	intr_rxi1,
+	intr_txi1,
+	intr_tei1,
+	intr_eri2,
+	intr_rxi2,
+	intr_txi2,
+	intr_tei2,
 };
 
 // vector[52] - vectors[63]
+// SCI0: 52 - 55，SCI1: 56 - 59，SCI2: 60 - 63
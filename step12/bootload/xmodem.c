@@ -3,6 +3,7 @@
 #include "defines.h"
 #include "serial.h"
 #include "lib.h"
+#include "timer.h"
 #include "xmodem.h"
 
 /*
@@ -19,6 +20,17 @@
 	③ EOT(0x04)を受けたら， ACK(0x06)を返して終了する
 	④ 中断したい場合はCAN(0x18)を送信する．
 		CAN(0x18)を受けたら中断する．
+
+	拡張（XMODEM-CRC / XMODEM-1K）
+	- ①でNAKの代わりに'C'を送ると，チェックサムの代わりにCRC-16（2バイト，上位が先）が付いてくる
+		'C'に応答が無ければ，CRCに対応していない送信側とみなしてNAKに切り替える
+	- SOHの代わりにSTX(0x02)で始まるブロックは1024バイト
+		ACKを待つ往復の回数が1/8になるので，転送時間が大きく縮む
+	- ACKが届かずに同じブロックが再送されてきたら，捨ててACKを返す
+
+	タイムアウト（タイマで測るので，クロックによって変わらない）
+	- ブロックの途中で1文字がXMODEM_CHAR_TIMEOUTミリ秒届かなければ，そのブロックはNAKで送り直してもらう
+	- ブロックとブロックの間がXMODEM_BLOCK_TIMEOUTミリ秒空いたら，送信側がいなくなったとみなして中断する
 */
 
 // 制御コードの定義
@@ -29,23 +41,121 @@
 #define XMODEM_NAK 0x15
 #define XMODEM_CAN 0x18
 #define XMODEM_EOF 0x1a // ctrl-z
+#define XMODEM_CRC 'C'	// CRCモードの要求（NAKの代わりに送る）
 
 #define XMODEM_BLOCK_SIZE 128
+#define XMODEM_BLOCK_SIZE_1K XMODEM_BUFFER_SIZE
+
+// 'C'を何回送っても応答が無ければ，チェックサムのモードに切り替える
+#define XMODEM_CRC_RETRY 3
+
+// タイムアウト（ミリ秒）
+#define XMODEM_NAK_INTERVAL 3000   // 受信開始まで'C'やNAKを送る間隔
+#define XMODEM_CHAR_TIMEOUT 1000   // ブロックの中の1文字
+#define XMODEM_BLOCK_TIMEOUT 10000 // 次のブロックの先頭
+#define XMODEM_PURGE_MSEC 100	   // エラーの後，回線がこれだけ静かになるまで読み捨てる
+#define XMODEM_START_TIMEOUT 60000 // 送信側: 受信側の'C'かNAKを待つ時間
+#define XMODEM_ACK_TIMEOUT 10000   // 送信側: ACKを待つ時間
+
+// 送信側: 同じブロックを何回送っても受け取ってもらえなければ中断する
+#define XMODEM_SEND_RETRY 10
+
+// CRCモードで受信しているか
+static int xmodem_crc_mode;
+// 受信開始までに'C'を送った回数（ノイズで受信開始を待ち直しても数え直さない）
+static int xmodem_crc_retry;
+
+/*
+	CRC-16（CCITT，多項式0x1021，初期値0）のテーブル
+	1バイトごとにテーブルを1回引くだけで済む（ビットごとに計算すると1バイトにシフトが8回）
+	256エントリ×2バイト＝512バイト．constなのでROMに置かれ，内蔵RAMは使わない
+*/
+static const uint16 crc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+// CRC-16の計算に1バイト加える
+#define CRC16_UPDATE(crc, c) ((uint16)(((unsigned int)(crc) << 8) ^ crc16_table[(((crc) >> 8) ^ (c)) & 0xff]))
+
+// タイムアウト付きの1文字受信（msecミリ秒の間に届かなければ-1）
+static int xmodem_getc(unsigned int msec)
+{
+	// すでに届いていればタイマは使わない（ブロックの受信中はほとんどこちら）
+	if (!serial_is_recv_enable(SERIAL_DEFAULT_DEVICE))
+	{
+		timer_start(TIMER_TIMEOUT, msec);
+		while (!serial_is_recv_enable(SERIAL_DEFAULT_DEVICE))
+		{
+			if (timer_is_expired(TIMER_TIMEOUT))
+				return -1;
+		}
+	}
+	return serial_recv_byte(SERIAL_DEFAULT_DEVICE);
+}
+
+// エラーのあったブロックの残りを読み捨てる（送信側が送り終えて回線が静かになるまで）
+// 途中で抜けたブロックの残りを次のブロックの先頭と間違えないように，NAKを返す前に呼ぶ
+// 1文字分の時間より十分長く待つ（USBシリアルの変換器はまとめて送ってくるので，文字の間が空くことがある）
+static void xmodem_purge(void)
+{
+	while (xmodem_getc(XMODEM_PURGE_MSEC) >= 0)
+		;
+}
 
 // 受信開始されるまで送信要求出す （受信側①）
+// 'C'の回数と送信間隔のタイマはxmodem_recv()で初期化する（ノイズで呼び直されてもリセットしない）
 static int xmodem_wait(void)
 {
-	long cnt = 0;
-
 	// 受信開始するまで，　NAKを定期的に送信する
 	while (!serial_is_recv_enable(SERIAL_DEFAULT_DEVICE))
 	{
-		// バグになり得る．　serial_is_recv_enableでチェックが行われた直後で，カウンタが条件を満たして，NAKを送信してしまう可能性がある　-> 受信エラーになる
+		// バグになり得る．　serial_is_recv_enableでチェックが行われた直後で，タイマが満了して，NAKを送信してしまう可能性がある　-> 受信エラーになる
 		// まあ失敗したらリセットしてやり直せば良い
-		if (++cnt >= 2000000) // 8秒間隔
+		if (timer_is_expired(TIMER_INTERVAL))
 		{
-			cnt = 0;
-			serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_NAK);
+			timer_start(TIMER_INTERVAL, XMODEM_NAK_INTERVAL);
+			// まずは'C'でCRCモードを要求し，応答が無ければNAKでチェックサムのモードにする
+			if (xmodem_crc_retry < XMODEM_CRC_RETRY)
+			{
+				xmodem_crc_retry++;
+				serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_CRC);
+			}
+			else
+			{
+				xmodem_crc_mode = 0;
+				serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_NAK);
+			}
 		}
 	}
 
@@ -53,34 +163,65 @@ static int xmodem_wait(void)
 }
 
 // ブロック単位の受信 (受信側②)
-static int xmodem_read_block(unsigned char block_number, char *buf)
+// 受信したサイズを返す．前のブロックの再送なら0，エラーなら-1
+static int xmodem_read_block(unsigned char block_number, char *buf, int block_size)
 {
-	unsigned char c, block_num, check_sum;
-	int i;
+	unsigned char block_num, check_sum;
+	uint16 crc;
+	int c, i;
 
 	// 1. ブロック番号の受信
-	block_num = serial_recv_byte(SERIAL_DEFAULT_DEVICE);
-	if (block_num != block_number)
-		return -1; // 想定しているブロック番号じゃなかたらエラー
+	if ((c = xmodem_getc(XMODEM_CHAR_TIMEOUT)) < 0)
+		return -1;
+	block_num = c;
 
 	// 2. 反転したブロック番号の受信
-	block_num ^= serial_recv_byte(SERIAL_DEFAULT_DEVICE);
-	if (block_num != 0xff)
+	if ((c = xmodem_getc(XMODEM_CHAR_TIMEOUT)) < 0)
+		return -1;
+	if ((block_num ^ c) != 0xff)
 		return -1; // 想定しているブロック番号じゃなかたらエラー
 
-	// 3. 128バイトのデータを受信
+	// 3. 128(1024)バイトのデータを受信
+	// 前のブロックの再送かもしれないので，データは読み捨てても良いように一旦bufに受ける
 	check_sum = 0;
-	for (i = 0; i < XMODEM_BLOCK_SIZE; i++)
+	crc = 0;
+	for (i = 0; i < block_size; i++)
 	{
 		// 1文字の受信
-		c = serial_recv_byte(SERIAL_DEFAULT_DEVICE);
+		if ((c = xmodem_getc(XMODEM_CHAR_TIMEOUT)) < 0)
+			return -1;
 		*(buf++) = c;
-		check_sum += c;
+		if (xmodem_crc_mode)
+			crc = CRC16_UPDATE(crc, c);
+		else
+			check_sum += c;
+	}
+
+	// 4. チェックサム（CRCモードならCRC-16の上位・下位）の受信
+	if (xmodem_crc_mode)
+	{
+		if ((c = xmodem_getc(XMODEM_CHAR_TIMEOUT)) < 0)
+			return -1;
+		crc ^= (unsigned int)c << 8;
+		if ((c = xmodem_getc(XMODEM_CHAR_TIMEOUT)) < 0)
+			return -1;
+		crc ^= c;
+		if (crc)
+			return -1;
+	}
+	else
+	{
+		if ((c = xmodem_getc(XMODEM_CHAR_TIMEOUT)) < 0)
+			return -1;
+		check_sum ^= c;
+		if (check_sum)
+			return -1;
 	}
 
-	// 4. チェックサムの受信
-	check_sum ^= serial_recv_byte(SERIAL_DEFAULT_DEVICE);
-	if (check_sum)
+	// ACKが届かずに前のブロックが再送されてきた（読み捨てて，ACKを返す）
+	if (block_num == (unsigned char)(block_number - 1))
+		return 0;
+	if (block_num != block_number)
 		return -1; // 想定しているブロック番号じゃなかたらエラー
 
 	return i;
@@ -88,11 +229,15 @@ static int xmodem_read_block(unsigned char block_number, char *buf)
 
 // XMODEMの全体処理
 // すべての受信したブロックのサイズを返す
-long xmodem_recv(char *buf)
+long xmodem_recv(char *buf, int (*func)(char *buf, int size))
 {
-	int r, receiving = 0;
+	int c, r, receiving = 0;
 	long size = 0;
-	unsigned char c, block_number = 1;
+	unsigned char block_number = 1;
+
+	xmodem_crc_mode = 1;
+	xmodem_crc_retry = 0;
+	timer_start(TIMER_INTERVAL, XMODEM_NAK_INTERVAL);
 
 	for (;;)
 	{
@@ -100,8 +245,9 @@ long xmodem_recv(char *buf)
 		if (!receiving)
 			xmodem_wait(); // 受信開始されるまで送信要求を出す
 
-		// 1文字の受信
-		c = serial_recv_byte(SERIAL_DEFAULT_DEVICE);
+		// 1文字の受信（送信側がいなくなったら中断する）
+		if ((c = xmodem_getc(XMODEM_BLOCK_TIMEOUT)) < 0)
+			return -1;
 
 		if (c == XMODEM_EOT) // EOTを受信したら終了 (受信側③)
 		{
@@ -112,20 +258,39 @@ long xmodem_recv(char *buf)
 		{
 			return -1;
 		}
-		else if (c == XMODEM_SOH) // SOHを受信したらデータ受信を開始 (受信側②)
+		else if (c == XMODEM_SOH || c == XMODEM_STX) // SOH(STX)を受信したらデータ受信を開始 (受信側②)
 		{
 			receiving++;
-			r = xmodem_read_block(block_number, buf); // ブロック単位での受信
+			// ブロック単位での受信（STXなら1024バイト）
+			r = xmodem_read_block(block_number, buf, (c == XMODEM_STX) ? XMODEM_BLOCK_SIZE_1K : XMODEM_BLOCK_SIZE);
 
-			if (r < 0) // 受信エラー時にはNAK返す
+			if (r < 0) // 受信エラー時には，ブロックの残りを読み捨ててからNAK返す
 			{
+				xmodem_purge();
 				serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_NAK);
 			}
+			else if (r == 0) // 前のブロックの再送はACKだけ返す
+			{
+				serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_ACK);
+			}
 			else // 正常受信時にはバッファのポインタを進めACKを返す
 			{
+				// ブロックごとに処理する（ACKを返すまで送信側は待っているので，受信を取りこぼさない）
+				if (func)
+				{
+					if (func(buf, r) < 0)
+					{
+						serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_CAN);
+						serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_CAN);
+						return -1;
+					}
+				}
+				else
+				{
+					buf += r;
+				}
 				block_number++;
 				size += r;
-				buf += r;
 				serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_ACK);
 			}
 		}
@@ -139,3 +304,92 @@ long xmodem_recv(char *buf)
 
 	return size;
 }
+
+// ブロック単位の送信（送信側）
+// 残りがblock_sizeに満たなければ，EOFで埋める
+static void xmodem_send_block(unsigned char block_number, char *buf, long size, int block_size)
+{
+	unsigned char c, check_sum = 0;
+	uint16 crc = 0;
+	int i;
+
+	serial_send_byte(SERIAL_DEFAULT_DEVICE, (block_size == XMODEM_BLOCK_SIZE) ? XMODEM_SOH : XMODEM_STX);
+	serial_send_byte(SERIAL_DEFAULT_DEVICE, block_number);
+	serial_send_byte(SERIAL_DEFAULT_DEVICE, ~block_number);
+	for (i = 0; i < block_size; i++)
+	{
+		c = (i < size) ? buf[i] : XMODEM_EOF;
+		if (xmodem_crc_mode)
+			crc = CRC16_UPDATE(crc, c);
+		else
+			check_sum += c;
+		serial_send_byte(SERIAL_DEFAULT_DEVICE, c);
+	}
+	if (xmodem_crc_mode)
+	{
+		serial_send_byte(SERIAL_DEFAULT_DEVICE, crc >> 8);
+		serial_send_byte(SERIAL_DEFAULT_DEVICE, crc);
+	}
+	else
+	{
+		serial_send_byte(SERIAL_DEFAULT_DEVICE, check_sum);
+	}
+}
+
+// どこから？
+// 『bootload/main.c』の『main関数（xdumpコマンド）』
+// XMODEMでの送信（メモリの内容をホストに吸い出す）．送信したサイズを返す（エラーなら-1）
+// 受信側が'C'で始めたら，CRC-16で1024バイトのブロック（残りが少なければ128バイト）を送る
+long xmodem_send(char *buf, long size)
+{
+	int c, retry, block_size;
+	unsigned char block_number = 1;
+	long pos = 0;
+
+	// 受信側の準備ができるのを待つ
+	for (;;)
+	{
+		if ((c = xmodem_getc(XMODEM_START_TIMEOUT)) < 0 || c == XMODEM_CAN)
+			return -1;
+		if (c == XMODEM_CRC || c == XMODEM_NAK)
+			break;
+	}
+	xmodem_crc_mode = (c == XMODEM_CRC);
+	// 受信側は開始の文字を何度か送ってくるので，残りをACKやNAKと間違えないように読み捨てる
+	xmodem_purge();
+
+	while (pos < size)
+	{
+		block_size = (xmodem_crc_mode && size - pos > XMODEM_BLOCK_SIZE) ? XMODEM_BLOCK_SIZE_1K : XMODEM_BLOCK_SIZE;
+		for (retry = 0;; retry++)
+		{
+			if (retry >= XMODEM_SEND_RETRY)
+			{
+				serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_CAN);
+				serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_CAN);
+				return -1;
+			}
+			// 送り直す時は，前の応答の残り（化けた文字や遅れて届いたNAK）を読み捨ててから
+			if (retry)
+				xmodem_purge();
+			xmodem_send_block(block_number, buf + pos, size - pos, block_size);
+			// NAKやタイムアウトなら送り直す
+			if ((c = xmodem_getc(XMODEM_ACK_TIMEOUT)) == XMODEM_ACK)
+				break;
+			if (c == XMODEM_CAN)
+				return -1;
+		}
+		pos += block_size;
+		block_number++;
+	}
+
+	// 終わりを知らせる（ACKが返るまで繰り返す）
+	for (retry = 0; retry < XMODEM_SEND_RETRY; retry++)
+	{
+		serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_EOT);
+		if (xmodem_getc(XMODEM_ACK_TIMEOUT) == XMODEM_ACK)
+			return size;
+	}
+
+	return -1;
+}
@@ -1,7 +1,15 @@
 #ifndef _XMODEM_H_INCLUDED_
 #define _XMODEM_H_INCLUDED_
 
+// 受信バッファに必要なサイズ（1ブロックの最大サイズ）
+#define XMODEM_BUFFER_SIZE 1024
+
 // xmodemによるファイルの受信
-long xmodem_recv(char *buf);
+// funcがNULLならbufに続けて受信する．NULLでなければ，bufはブロック単位の受信バッファにして
+// 受信したブロックごとにfuncを呼ぶ（ACKを返す前に呼ぶ．-1を返したら受信を中断する）
+long xmodem_recv(char *buf, int (*func)(char *buf, int size));
+
+// xmodemによるファイルの送信（bufからsizeバイト）
+long xmodem_send(char *buf, long size);
 
 #endif
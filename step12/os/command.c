@@ -5,35 +5,51 @@
 
 // コンソールドライバの使用開始をコンソールドライバに依頼
 // コンソールの初期化を依頼する
-static void send_use(int index)
+// メッセージバッファが枯渇して送れなければ，領域はこちらの所有のままなので解放する
+static int send_use(int index)
 {
 	char *p;
 	// コマンド通知用の領域を獲得
 	p = kz_kmalloc(3);
-	p[0] = '0';
+	// コンソールの番号はシリアルの番号と同じ
+	p[0] = '0' + index;
 	// 初期化コマンドを設定
 	p[1] = CONSDRV_CMD_USE;
 	p[2] = '0' + index;
 	// コンソールドライバスレッドに送信
-	kz_send(MSGBOX_ID_CONSOUTPUT, 3, p);
+	if (kz_send(MSGBOX_ID_CONSOUTPUT, 3, p) < 0)
+	{
+		kz_kmfree(p);
+		return -1;
+	}
+	return 0;
 }
 
-// コンソールへの文字列出力をコンソールドライバに依頼する
-// 文字列の出力を依頼
+// コンソールへの文字列出力
+// 以前はメッセージでコンソールドライバに依頼していたが（領域の獲得とコピーが2回，スレッドの切り替えが2回），
+// 送信バッファに直接書き込むようにした
 static void send_write(char *str)
+{
+	kz_cons_write(SERIAL_DEFAULT_DEVICE, str, strlen(str));
+}
+
+// パラメータ付きのコマンドをコンソールドライバに依頼する（ボーレートの変更など）
+static int send_command(int command, char *param)
 {
 	char *p;
 	int len;
-	len = strlen(str);
-	// コマンド通知用の領域を獲得
+	len = strlen(param);
 	p = kz_kmalloc(len + 2);
-	// コンソールドライバスレッドに対するコマンド発行の実体
-	// 実際にはコマンドとパラメータをメモリ上に詰め込み、メッセージでコンソールドライバスレッドに送信するだけ
-	p[0] = '0';				  // コマンド
-	p[1] = CONSDRV_CMD_WRITE; // パラメータ
-	memcpy(&p[2], str, len);
-	// コンソールドライバスレッドに送信
-	kz_send(MSGBOX_ID_CONSOUTPUT, len + 2, p);
+	p[0] = '0' + SERIAL_DEFAULT_DEVICE; // コンソールの番号
+	p[1] = command;						// コマンド
+	memcpy(&p[2], param, len);
+	if (kz_send(MSGBOX_ID_CONSOUTPUT, len + 2, p) < 0)
+	{
+		kz_kmfree(p);
+		send_write("command failed.\n");
+		return -1;
+	}
+	return 0;
 }
 
 int command_main(int arvc, char *argv[])
@@ -42,7 +58,9 @@ int command_main(int arvc, char *argv[])
 	int size;
 
 	// コンソールドライバスレッドにコンソールの初期化を依頼する
-	send_use(SERIAL_DEFAULT_DEVICE);
+	// 起動直後でメッセージバッファが空いていないことは無いはずだが，送れるまで繰り返す
+	while (send_use(SERIAL_DEFAULT_DEVICE) < 0)
+		kz_wait();
 
 	while (1)
 	{
@@ -50,7 +68,7 @@ int command_main(int arvc, char *argv[])
 
 		// コンソールドライバスレッドから受信文字列を受け取る
 		// -> pに入る
-		kz_recv(MSGBOX_ID_CONSINPUT, &size, &p);
+		kz_recv(MSGBOX_ID_CONSINPUT0 + SERIAL_DEFAULT_DEVICE, &size, &p);
 		p[size] = '\0';
 
 		// echoコマンドの処理
@@ -61,6 +79,22 @@ int command_main(int arvc, char *argv[])
 			send_write(p + 4);
 			send_write("\n");
 		}
+		// baudコマンドの処理（例: baud 57600）
+		// 結果はコンソールドライバが表示する．端末側の速度も合わせて変更すること
+		else if (!strncmp(p, "baud ", 5))
+		{
+			send_command(CONSDRV_CMD_BAUD, p + 5);
+		}
+		// flowコマンドの処理（flow none / flow xon / flow hard）
+		else if (!strncmp(p, "flow ", 5))
+		{
+			send_command(CONSDRV_CMD_FLOW, (p[5] == 'x') ? "x" : ((p[5] == 'h') ? "h" : "n"));
+		}
+		// serstatコマンドの処理（捨てた文字数と受信エラーの回数を表示）
+		else if (!strncmp(p, "serstat", 7))
+		{
+			send_command(CONSDRV_CMD_STAT, "");
+		}
 		else
 		{
 			send_write("unknown.\n");
@@ -22,7 +22,7 @@
 	- SOFTVEC_TYPE_NUM
 	- SOFTVEC_TYPE_SOFTERR
 	- SOFTVEC_TYPE_SYSCALL
-	- SOFTVEC_TYPE_SERINTR
+	- SOFTVEC_TYPE_SCI()
 */
 #include "intr.h"
 /*
@@ -45,8 +45,17 @@
 	- CONSDRV_CMD_WRITE
 */
 #include "consdrv.h"
+#ifdef CONSDRV_DMA
+#include "dma.h"
+#endif
+#include "timer.h"
+#include "klog.h"
 
-#define CONS_BUFFER_SIZE 24
+// 送信バッファのサイズは2の累乗にする（リングバッファの添字をマスクで折り返すため）
+#define CONS_SEND_MASK (CONSDRV_SEND_BUFFER_SIZE - 1)
+// 書き込みを待っているスレッドは，送信バッファが半分まで空いてから起こす
+// （一文字ごとに起こすと，一文字書いてはまたスリープするのを繰り返すことになる）
+#define CONS_SEND_LOWAT (CONSDRV_SEND_BUFFER_SIZE / 2)
 
 static struct consreg
 {
@@ -55,53 +64,384 @@ static struct consreg
 	// 利用するシリアル番号
 	int index;
 
-	// 送信バッファ
+	// 送信バッファ（リングバッファ）
 	char *send_buf;
 	// 受信バッファ
 	char *recv_buf;
-	// 送信バッファ中のデータサイズ
-	int send_len;
+	// 送信バッファの読み出し位置（割込みハンドラが進める）と書き込み位置（send_string()が進める）
+	// 折り返さずに増やし続けて，バッファを参照する時にマスクする．tail - headがデータサイズになる
+	unsigned int send_head;
+	unsigned int send_tail;
 	// 受信バッファ中のデータサイズ
 	int recv_len;
 
+	// 送信バッファが空くのを待っているスレッド（コンソールドライバスレッド）
+	kz_thread_id_t writer;
+	// 送信バッファが一杯で捨てた文字数（割込みからのエコーバックは待てないので捨てる）
+	int send_drop;
+	// 受信バッファが一杯で捨てた文字数
+	int recv_drop;
+
+	// DMAで転送中のバイト数（0なら転送していない．DMAで送信できるのはSCI0のみ）
+	int dma_len;
+
+	// rawモード（バイナリ用）の受信リングバッファ
+	// 0以外ならrawモード．この数だけ溜まるか，受信が途切れてから一定時間経ったら通知する
+	int raw_chunk;
+	// 受信が途切れたとみなす時間（ミリ秒）
+	int raw_timeout;
+	// 受信リングバッファの位置（どれも折り返さずに増やし続ける）
+	//   raw_head: 受信スレッドが解放済み（ここまでは上書きしてよい）
+	//   raw_sent: 受信スレッドに通知済み
+	//   raw_tail: 受信割込みが書き込んだ位置
+	unsigned int raw_head;
+	unsigned int raw_sent;
+	unsigned int raw_tail;
+
+	// フロー制御の方式（CONSDRV_FLOW_NONEなど）
+	int flow;
+	// フロー制御の状態（CONS_FLOW_RX_STOPPEDなど）
+	int flow_state;
+	// 送信待ちのXON/XOFF（送信バッファより先に送る．0なら無し）
+	int flow_char;
+	// 受信エラーの回数（オーバーラン・フレーミングエラー・パリティエラー）
+	int err_orer;
+	int err_fer;
+	int err_per;
+
 	// ダミーメンバでサイズ調整（乗算が発生しないように）
 	long dummy[3];
 } consreg[CONSDRV_DEVICE_NUM];
 // 複数のコンソールを管理可能にするために，配列にする
 
+// rawモードの受信リングバッファ（サイズは2の累乗）
+// 受信スレッドにはこの中を指すポインタをそのまま渡す（コピーしない）．
+// kzmemの領域ではないので，メッセージで渡しても所有スレッドの付け替えは行われない
+static char rawbuf[CONSDRV_DEVICE_NUM][CONSDRV_RAW_BUFFER_SIZE];
+#define CONS_RAW_MASK (CONSDRV_RAW_BUFFER_SIZE - 1)
+
+// フロー制御 ----------------------------
+
+#define CONS_XON 0x11
+#define CONS_XOFF 0x13
+
+#define CONS_FLOW_RX_STOPPED (1 << 0) // 相手に送信を止めてもらっている
+#define CONS_FLOW_TX_STOPPED (1 << 1) // 相手から送信を止められている
+
+// CTSが戻るのを調べるタイマ（0〜2はrawモードで使う）
+#define CONS_FLOW_TIMER 3
+#define CONS_FLOW_POLL_MSEC 10
+
 // シリアル送信部分 ----------------------------
 
+// kz_cons_write()で一度に割込み禁止で書き込む最大のバイト数
+#define CONS_WRITE_CHUNK 32
+
+// 送信バッファ中のデータサイズ
+#define send_len(cons) ((cons)->send_tail - (cons)->send_head)
+
 // 送信バッファ（変数: send_buf）の先頭一文字を送信
+// 以前は送信するたびに残りのデータを一文字ずつ前に詰めていたが（n文字でO(n^2)），
+// リングバッファにしたので読み出し位置を進めるだけでよい
+// 送信バッファが空くのを待っているなら起こす（割込みハンドラからなのでサービスコール）
+static void send_wakeup(struct consreg *cons)
+{
+	if (cons->writer)
+	{
+		kx_wakeup(cons->writer);
+		cons->writer = 0;
+	}
+}
+
 static void send_char(struct consreg *cons)
 {
-	int i;
-	serial_send_byte(cons->index, cons->send_buf[0]);
-	cons->send_len--;
-	for (i = 0; i < cons->send_len; i++)
-		cons->send_buf[i] = cons->send_buf[i + 1];
+	// XON/XOFFは送信バッファに溜まっている文字より先に送る
+	if (cons->flow_char)
+	{
+		serial_send_byte(cons->index, cons->flow_char);
+		cons->flow_char = 0;
+		return;
+	}
+	serial_send_byte(cons->index, cons->send_buf[cons->send_head & CONS_SEND_MASK]);
+	cons->send_head++;
+	if (send_len(cons) <= CONS_SEND_LOWAT)
+		send_wakeup(cons);
+}
+
+// 相手が受信できるか（止められていたら送信しない）
+// RTS/CTSの時はCTSを見る．落ちていたら，戻ったかどうかをタイマで定期的に調べる
+static int send_allowed(struct consreg *cons)
+{
+	if (cons->flow == CONSDRV_FLOW_RTSCTS)
+	{
+		if (serial_is_cts(cons->index))
+			cons->flow_state &= ~CONS_FLOW_TX_STOPPED;
+		else if (!(cons->flow_state & CONS_FLOW_TX_STOPPED))
+		{
+			cons->flow_state |= CONS_FLOW_TX_STOPPED;
+			timer_start(CONS_FLOW_TIMER, CONS_FLOW_POLL_MSEC);
+		}
+	}
+	return !(cons->flow_state & CONS_FLOW_TX_STOPPED);
+}
+
+// 受信側のフロー制御の文字（XON/XOFF）の送信
+// 送信が止まっていればすぐに送り，送信中なら次の送信割込みで送信バッファより先に送る
+static void send_flow_char(struct consreg *cons, int c)
+{
+#ifdef CONSDRV_DMA
+	if (cons->dma_len)
+	{
+		cons->flow_char = c;
+		return;
+	}
+#endif
+	if (serial_intr_is_send_enable(cons->index))
+		cons->flow_char = c;
+	else
+		serial_send_byte(cons->index, c);
+}
+
+// 受信バッファの使用量を見て，相手の送信を止める・再開させる
+// 3/4を超えたら止めて，1/4を下回ったら再開させる（止めてから実際に止まるまでに届く分の余裕を残す）
+// 受信割込みと，受信データを消費した時に呼ぶ（スレッドからは割込み禁止で）
+static void flow_rx_check(struct consreg *cons)
+{
+	int used, size;
+
+	if (cons->flow == CONSDRV_FLOW_NONE)
+		return;
+
+	if (cons->raw_chunk)
+	{
+		used = cons->raw_tail - cons->raw_head;
+		size = CONSDRV_RAW_BUFFER_SIZE;
+	}
+	else
+	{
+		used = cons->recv_len;
+		size = CONSDRV_RECV_BUFFER_SIZE;
+	}
+
+	if (!(cons->flow_state & CONS_FLOW_RX_STOPPED) && used >= size - (size >> 2))
+	{
+		cons->flow_state |= CONS_FLOW_RX_STOPPED;
+		if (cons->flow == CONSDRV_FLOW_XONXOFF)
+			send_flow_char(cons, CONS_XOFF);
+		else
+			serial_set_rts(cons->index, 0);
+	}
+	else if ((cons->flow_state & CONS_FLOW_RX_STOPPED) && used <= (size >> 2))
+	{
+		cons->flow_state &= ~CONS_FLOW_RX_STOPPED;
+		if (cons->flow == CONSDRV_FLOW_XONXOFF)
+			send_flow_char(cons, CONS_XON);
+		else
+			serial_set_rts(cons->index, 1);
+	}
+}
+
+#ifdef CONSDRV_DMA
+// フロー制御をしている時に，一度にDMAで送る最大のバイト数
+// 転送中はXON/XOFFを割り込ませられず，CTSも見られないので，
+// 止められてから実際に止まるまでに送ってしまう量を，受信FIFOのあるUART（16バイト）程度に抑える
+#define CONS_DMA_FLOW_CHUNK 16
+
+// 送信バッファの先頭から，折り返さずに続いている部分をまとめてDMAで送信する
+// 送信割込み（TXI）がDMACを起動するので，CPUには割込みが入らない．送り終わったら転送終了割込みが入る
+static void send_dma(struct consreg *cons)
+{
+	int pos = cons->send_head & CONS_SEND_MASK;
+	int len = send_len(cons);
+
+	if (len > CONSDRV_SEND_BUFFER_SIZE - pos)
+		len = CONSDRV_SEND_BUFFER_SIZE - pos;
+	if (cons->flow != CONSDRV_FLOW_NONE && len > CONS_DMA_FLOW_CHUNK)
+		len = CONS_DMA_FLOW_CHUNK;
+	cons->dma_len = len;
+	dma_send_start(cons->index, cons->send_buf + pos, len);
+	serial_intr_send_enable(cons->index);
+}
+#endif
+
+// 送信が止まっていれば，送信割込みを有効にして先頭一文字を送信
+// 後続の文字列は，送信完了後，送信割り込みの延長で処理される．
+static void send_start(struct consreg *cons)
+{
+	// 相手から送信を止められている
+	if (!send_allowed(cons))
+		return;
+#ifdef CONSDRV_DMA
+	// DMAで送信できるシリアルなら，DMAの転送終了割込みの延長で後続を送る
+	if (cons->index == DMA_SERIAL_INDEX)
+	{
+		if (send_len(cons) && !cons->dma_len)
+			send_dma(cons);
+		return;
+	}
+#endif
+	if (send_len(cons) && !serial_intr_is_send_enable(cons->index))
+	{
+		serial_intr_send_enable(cons->index);
+		send_char(cons);
+	}
+}
+
+// 送信バッファに一文字書き込み
+// 送信が進むまでスリープする（スレッドから，割込み禁止で呼ぶこと）
+// 送信割込みで一文字送信されたら起こしてもらう
+// 割込み禁止のまま呼ばれているが，trapa命令は割込み禁止でも発行できる
+// コンソールドライバとkz_cons_write()を呼んだスレッドが同時に待つことがあるので，
+// 先に待っていたスレッドを覚えておき，起こされたら順に起こす
+static void send_wait(struct consreg *cons)
+{
+	kz_thread_id_t prev;
+
+	send_start(cons);
+	prev = cons->writer;
+	cons->writer = kz_getid();
+	kz_sleep();
+	if (prev)
+		kz_wakeup(prev);
 }
 
-// ①文字列を送信バッファに書き込み
+// バッファが一杯の時，blockが0以外なら空くまでスリープする（スレッドから呼ばれた時のみ）．0なら捨てる
+static void send_put(struct consreg *cons, char c, int block)
+{
+	while (send_len(cons) >= CONSDRV_SEND_BUFFER_SIZE)
+	{
+		if (!block)
+		{
+			cons->send_drop++;
+			return;
+		}
+		send_wait(cons);
+	}
+	cons->send_buf[cons->send_tail++ & CONS_SEND_MASK] = c;
+}
+
+// カーネルのログ（klog.c）を送信バッファに移す
+// ユーザの出力の途中に割り込まないように，送信バッファが空いた時だけ移す
+// ログはデフォルトのシリアルのコンソールに出す
+static void klog_pull(struct consreg *cons)
+{
+	char c;
+
+	if (cons->index != SERIAL_DEFAULT_DEVICE || !cons->id || send_len(cons))
+		return;
+	while (send_len(cons) < CONSDRV_SEND_BUFFER_SIZE && klog_read(&c, 1))
+		cons->send_buf[cons->send_tail++ & CONS_SEND_MASK] = c;
+}
+
+// どこから？
+// 『klog.c』の『klog_puts関数』（カーネルの中から割込み禁止で呼ばれる）
+// ログが書き込まれたら，送信が止まっていれば送り始める
+// 送信中なら，送信バッファが空いた時に送信割込みの延長で移される
+static void consdrv_klog_kick(void)
+{
+	struct consreg *cons = &consreg[SERIAL_DEFAULT_DEVICE];
+
+	klog_pull(cons);
+	send_start(cons);
+}
+
+// どこから？
+// 『klog.c』の『klog_flush関数』（kz_sysdown()から割込み禁止で呼ばれる）
+// 停止する前に，デフォルトのコンソールの送信バッファに残っている分をビジーループで送り出す
+// klog_pull()でログを移した後は送信割込みが入らないので，ここで送らないと失われてしまう
+static void consdrv_klog_flush(void)
+{
+	struct consreg *cons = &consreg[SERIAL_DEFAULT_DEVICE];
+
+#ifdef CONSDRV_DMA
+	// DMACはCPUの割込み禁止とは関係なく動くので，転送中の分は終わるのを待つ
+	if (cons->dma_len)
+	{
+		while (dma_is_busy(cons->index))
+			;
+		cons->send_head += cons->dma_len;
+		cons->dma_len = 0;
+	}
+#endif
+	if (cons->flow_char)
+	{
+		serial_send_byte(cons->index, cons->flow_char);
+		cons->flow_char = 0;
+	}
+	while (send_len(cons))
+		serial_send_byte(cons->index, cons->send_buf[cons->send_head++ & CONS_SEND_MASK]);
+}
+
+// ①文字列を送信バッファに書き込み（一杯なら送信が進むのを待つか捨てる）
 // ②送信割込みを有効
 // ③send_char関数を呼び出して先頭一文字を送信
-static void send_string(struct consreg *cons, char *str, int len)
+static void send_string(struct consreg *cons, char *str, int len, int block)
 {
 	// ①
 	int i;
 	for (i = 0; i < len; i++)
 	{
 		if (str[i] == '\n')
-			cons->send_buf[cons->send_len++] = '\r';
-		cons->send_buf[cons->send_len++] = str[i];
+			send_put(cons, '\r', block);
+		send_put(cons, str[i], block);
 	}
 
-	if (cons->send_len && !serial_intr_is_send_enable(cons->index))
+	// ②③
+	send_start(cons);
+}
+
+// どこから？
+// アプリケーションのスレッド（『command.c』の『send_write関数』など）
+// コンソールへの文字列出力（コンソールドライバスレッドを経由しない）
+// メッセージ用の領域の獲得・コピー・コンソールドライバスレッドへの切り替えをせずに，
+// 呼び出したスレッドが送信バッファに直接書き込む．送信バッファが一杯の時だけ空くまでスリープする
+// 割込み禁止の区間が長くならないように，少しずつ区切って書き込む
+int kz_cons_write(int index, char *buf, int len)
+{
+	struct consreg *cons;
+	int n, done = 0;
+
+	if (index < 0 || index >= CONSDRV_DEVICE_NUM)
+		return -1;
+	cons = &consreg[index];
+
+	while (done < len)
 	{
-		// ②
-		serial_intr_send_enable(cons->index);
-		// ③
-		send_char(cons);
-		// 後続の文字列は，送信完了後，送信割り込みの延長で処理される．
+		n = len - done;
+		if (n > CONS_WRITE_CHUNK)
+			n = CONS_WRITE_CHUNK;
+		INTR_DISABLE;
+		// 使用開始していないコンソール（バッファが無い）
+		if (!cons->id)
+		{
+			INTR_ENABLE;
+			return -1;
+		}
+		send_string(cons, buf + done, n, 1);
+		INTR_ENABLE;
+		done += n;
+	}
+
+	return done;
+}
+
+// rawモードで溜まっている受信データを受信スレッドに通知する（割込みハンドラから呼ぶ）
+// リングバッファの中を指すポインタをそのまま送る．折り返している場合は二つに分けて送る
+// 受信スレッドは処理し終えたらCONSDRV_CMD_RELEASEでそのサイズを返す
+static void raw_deliver(struct consreg *cons)
+{
+	int pos, len;
+
+	while (cons->raw_tail != cons->raw_sent)
+	{
+		pos = cons->raw_sent & CONS_RAW_MASK;
+		len = cons->raw_tail - cons->raw_sent;
+		if (len > CONSDRV_RAW_BUFFER_SIZE - pos)
+			len = CONSDRV_RAW_BUFFER_SIZE - pos;
+		// メッセージバッファが枯渇していたら次の機会に送る
+		if (kx_send(MSGBOX_ID_CONSINPUT0 + cons->index, len, rawbuf[cons->index] + pos) < 0)
+			break;
+		cons->raw_sent += len;
 	}
 }
 
@@ -115,53 +455,135 @@ static void send_string(struct consreg *cons, char *str, int len)
 	また非コンテキスト状態で呼ばれるため、システムコールは利用してはいけない
 	（代わりにサービスコールを利用すること）
 */
-static int consdrv_intrproc(struct consreg *cons)
+// eventは割込みの要因（SOFTVEC_TYPE_SCI_ERIなど）．ベクタごとに分かれて入ってくるので，ステータスレジスタを見て要因を探さなくてよい
+static int consdrv_intrproc(struct consreg *cons, int event)
 {
-	unsigned char c;
+	unsigned char c = 0;
 	char *p;
+	int received = 0; // 受信した文字をもう読み出したか
 
-	// 受信割込みの処理
-	if (serial_is_recv_enable(cons->index))
+	// 受信エラー割込みの処理
+	// エラーのフラグを落とさないと受信が止まってしまう．その文字は失われるので，捨てた文字として数える
+	if (event == SOFTVEC_TYPE_SCI_ERI)
+	{
+		int err = serial_clear_error(cons->index);
+		if (err & SERIAL_ERR_ORER)
+			cons->err_orer++;
+		if (err & SERIAL_ERR_FER)
+			cons->err_fer++;
+		if (err & SERIAL_ERR_PER)
+			cons->err_per++;
+		cons->recv_drop++;
+	}
+
+	// XON/XOFFの時は，受信した文字がXON/XOFFなら送信を止める・再開する（データとしては扱わない）
+	if (event == SOFTVEC_TYPE_SCI_RXI && cons->flow == CONSDRV_FLOW_XONXOFF)
 	{
-		// 受け取る
 		c = serial_recv_byte(cons->index);
+		if (c == CONS_XOFF)
+		{
+			cons->flow_state |= CONS_FLOW_TX_STOPPED;
+			event = -1;
+		}
+		else if (c == CONS_XON)
+		{
+			cons->flow_state &= ~CONS_FLOW_TX_STOPPED;
+			send_start(cons);
+			event = -1;
+		}
+		received = 1;
+	}
+
+	// rawモードの受信割込みの処理（エコーバックも改行コード変換もしない）
+	if (event == SOFTVEC_TYPE_SCI_RXI && cons->raw_chunk)
+	{
+		if (!received)
+			c = serial_recv_byte(cons->index);
+		// 受信スレッドが解放していない部分は上書きできないので捨てる
+		if (cons->raw_tail - cons->raw_head < CONSDRV_RAW_BUFFER_SIZE)
+			rawbuf[cons->index][cons->raw_tail++ & CONS_RAW_MASK] = c;
+		else
+			cons->recv_drop++;
+
+		// 溜まったら通知する．まだなら，受信が途切れた時のためにタイマを掛け直す
+		if (cons->raw_tail - cons->raw_sent >= cons->raw_chunk)
+		{
+			timer_cancel(cons->index);
+			raw_deliver(cons);
+		}
+		else
+		{
+			timer_start(cons->index, cons->raw_timeout);
+		}
+		flow_rx_check(cons);
+	}
+	// 受信割込みの処理（行単位のモード）
+	else if (event == SOFTVEC_TYPE_SCI_RXI)
+	{
+		// 受け取る
+		if (!received)
+			c = serial_recv_byte(cons->index);
 		// 改行コード変換
 		if (c == '\r')
 			c = '\n';
 
-		// エコーバック処理
-		send_string(cons, &c, 1);
+		// エコーバック処理（割込みハンドラなので送信バッファが空くのは待てない）
+		send_string(cons, &c, 1, 0);
 
 		if (cons->id)
 		{
 			if (c != '\n')
 			{
 				// 改行でないなら受信バッファにバッファリング（保存）
-				cons->recv_buf[cons->recv_len++] = c;
+				// 一杯ならその文字は捨てて数えておく（行はそこで切り詰められる）
+				if (cons->recv_len < CONSDRV_RECV_BUFFER_SIZE)
+					cons->recv_buf[cons->recv_len++] = c;
+				else
+					cons->recv_drop++;
 			}
 			else
 			{
 				// Enterが押されたら、バッファの内容をコマンド処理スレッドに通知する（割込みハンドラ上での処理なので、サービスコールを利用する）
 				// 必要なメモリを獲得
 				// ここで獲得されたメモリを解放するのはコマンドスレッドで、command.c内で解放される
-				p = kx_kmalloc(CONS_BUFFER_SIZE);
+				// 受信側で終端文字を付けるので，一文字分多く獲得する
+				p = kx_kmalloc(cons->recv_len + 1);
 				// 獲得したメモリに受信バッファの内容をコピー
 				memcpy(p, cons->recv_buf, cons->recv_len);
 				// 割込みハンドラ->スレッド　メッセージを送信
-				// MSGBOX_ID_CONSINPUTのメッセージボックスに送信（割込みの延長で処理が行われる）
-				kx_send(MSGBOX_ID_CONSINPUT, cons->recv_len, p);
+				// シリアルごとのMSGBOX_ID_CONSINPUTのメッセージボックスに送信（割込みの延長で処理が行われる）
+				// メッセージバッファが枯渇していたら，この行は捨てる
+				if (kx_send(MSGBOX_ID_CONSINPUT0 + cons->index, cons->recv_len, p) < 0)
+					kx_kmfree(p);
 				cons->recv_len = 0;
 			}
+			flow_rx_check(cons);
 		}
 	}
 
 	// 送信割込みの処理
-	if (serial_is_send_enable(cons->index))
+	if (event == SOFTVEC_TYPE_SCI_TXI)
 	{
-		if (!cons->id || !cons->send_len)
+		// 送信バッファが空になったら，溜まっているカーネルのログを続けて送る
+		klog_pull(cons);
+		// XON/XOFFは止められていても送る
+		if (cons->flow_char)
 		{
+			send_char(cons);
+		}
+		else if (!cons->id || !send_len(cons) || !send_allowed(cons))
+		{
+			// 止められている間は送信割込みを止めておき，再開する時にsend_start()で有効にする
 			serial_intr_send_disable(cons->index);
 		}
+#ifdef CONSDRV_DMA
+		// DMA転送中はTXIはDMACに渡るのでここには来ない．転送していない時に来たらDMAで送り始める
+		else if (cons->index == DMA_SERIAL_INDEX)
+		{
+			if (!cons->dma_len)
+				send_dma(cons);
+		}
+#endif
 		else
 		{
 			// 送信割込みが発生している場合は、送信バッファに蓄えられているデータの先頭一文字をsend_char()によって出力
@@ -196,50 +618,237 @@ static int consdrv_intrproc(struct consreg *cons)
 }
 
 // シリアルの割込みハンドラ
-static void consdrv_intr(void)
+// typeは割込みのベクタ番号．チャネルと要因はベクタ番号から分かるので，そのコンソールの要因の処理だけを行う
+// （以前は一つのハンドラで全コンソールのステータスレジスタを調べていた）
+static void consdrv_intr(short type)
 {
-	int i;
+	int index = (type - SOFTVEC_TYPE_SCI(0, 0)) >> 2;
+	struct consreg *cons = &consreg[index];
+
+	if (cons->id)
+		consdrv_intrproc(cons, type & 3);
+}
+
+// rawモードで受信が途切れた（タイマが満了した）時の割込みハンドラ
+// チャネルはコンソールの番号と同じ
+static void consdrv_timer_intr(short type)
+{
+	int index = (type - SOFTVEC_TYPE_TMR_CMIA(0)) >> 1;
 	struct consreg *cons;
 
-	for (i = 0; i < CONSDRV_DEVICE_NUM; i++)
+	timer_expire(index);
+
+	// CTSが戻ったか調べるタイマ．戻っていたら送信を再開する（戻っていなければsend_start()の中でタイマが掛け直される）
+	if (index == CONS_FLOW_TIMER)
 	{
-		cons = &consreg[i];
-		if (cons->id)
+		for (index = 0; index < CONSDRV_DEVICE_NUM; index++)
 		{
-			// シリアルの送信・受信割込みの状態をチェック
-			if (serial_is_send_enable(cons->index) || serial_is_recv_enable(cons->index))
-				// 割り込みが発生しているのならconsdrv_intrprocを呼び出す
-				consdrv_intrproc(cons);
+			cons = &consreg[index];
+			if (cons->id && cons->flow == CONSDRV_FLOW_RTSCTS && (cons->flow_state & CONS_FLOW_TX_STOPPED))
+			{
+				cons->flow_state &= ~CONS_FLOW_TX_STOPPED;
+				send_start(cons);
+			}
 		}
+		return;
+	}
+
+	cons = &consreg[index];
+	if (cons->id && cons->raw_chunk)
+		raw_deliver(cons);
+}
+
+#ifdef CONSDRV_DMA
+// DMAの転送終了割込みのハンドラ
+// 送り終えた分だけ読み出し位置を進め，残っていれば次の部分を送る
+static void consdrv_dma_intr(short type)
+{
+	struct consreg *cons = &consreg[DMA_SERIAL_INDEX];
+
+	dma_send_end(cons->index);
+	cons->send_head += cons->dma_len;
+	cons->dma_len = 0;
+	send_wakeup(cons);
+
+	// 転送中に溜まったXON/XOFFを送る
+	if (cons->flow_char)
+	{
+		serial_send_byte(cons->index, cons->flow_char);
+		cons->flow_char = 0;
 	}
+
+	klog_pull(cons);
+	if (cons->id && send_len(cons) && send_allowed(cons))
+		send_dma(cons);
+	else
+		serial_intr_send_disable(cons->index);
 }
+#endif
 
 // コンソール制御用の構造体の配列（consreg[]）の初期化
 static int consdrv_init(void)
 {
 	memset(consreg, 0, sizeof(consreg));
+#ifdef CONSDRV_DMA
+	dma_init();
+#endif
+	klog_set_kick(consdrv_klog_kick);
+	klog_set_flush(consdrv_klog_flush);
 	return 0;
 }
 
+// ボーレートの変更（コンソールドライバスレッドから割込み禁止で呼ぶ）
+// 結果（実際の誤差）はそのコンソールに表示する．変更できたら新しい速度で表示される
+// コマンドのパラメータを取り出す（メッセージの文字列は終端されていないのでコピーして終端する）
+static char *consdrv_param(char *buf, int size, char *str, int len)
+{
+	if (len > size - 1)
+		len = size - 1;
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+	return buf;
+}
+
+static void consdrv_baud(struct consreg *cons, char *str, int len)
+{
+	char buf[12];
+	unsigned long bps, r;
+	int err = 0, ret;
+
+	bps = atoul(consdrv_param(buf, sizeof(buf), str, len));
+
+	// 送信バッファに残っている文字を今の速度で送り切る
+	while (send_len(cons))
+		send_wait(cons);
+	ret = serial_set_baud(cons->index, bps, &err);
+
+	send_string(cons, ret ? "baud rate not supported: " : "baud rate: ", ret ? 25 : 11, 1);
+	send_string(cons, buf, ultostr(bps, buf), 1);
+	send_string(cons, " (error ", 8, 1);
+	if (err < 0)
+	{
+		send_string(cons, "-", 1, 1);
+		err = -err;
+	}
+	// 千分率を百分率（小数点以下1桁）で表示
+	send_string(cons, buf, ultostr(udivmod(err, 10, &r), buf), 1);
+	buf[0] = '.';
+	buf[1] = '0' + r;
+	send_string(cons, buf, 2, 1);
+	send_string(cons, "%)\n", 3, 1);
+}
+
 // 他スレッドからのコマンドを処理する
+// フロー制御の方式の変更
+static void consdrv_flow(struct consreg *cons, int mode)
+{
+	INTR_DISABLE;
+	// 止めていた相手の送信は再開させ，止められていた送信も再開してから方式を切り替える
+	if (cons->flow_state & CONS_FLOW_RX_STOPPED)
+	{
+		if (cons->flow == CONSDRV_FLOW_XONXOFF)
+			send_flow_char(cons, CONS_XON);
+		else if (cons->flow == CONSDRV_FLOW_RTSCTS)
+			serial_set_rts(cons->index, 1);
+	}
+	cons->flow_state = 0;
+
+	switch (mode)
+	{
+	case 'x':
+		cons->flow = CONSDRV_FLOW_XONXOFF;
+		break;
+	case 'h':
+		cons->flow = CONSDRV_FLOW_RTSCTS;
+		serial_flow_init(cons->index);
+		break;
+	default:
+		cons->flow = CONSDRV_FLOW_NONE;
+		break;
+	}
+	// 今のバッファの状態で止めるべきなら止める
+	flow_rx_check(cons);
+	send_start(cons);
+	INTR_ENABLE;
+}
+
+// 一つの数値を"名前 値\n"の形で送信バッファに書き込む（割込み禁止で呼ぶこと）
+static void consdrv_stat_put(struct consreg *cons, char *name, unsigned long value)
+{
+	char buf[12];
+	int len;
+
+	send_string(cons, name, strlen(name), 1);
+	len = ultostr(value, buf);
+	send_string(cons, buf, len, 1);
+	send_string(cons, "\n", 1, 1);
+}
+
+// 捨てた文字数と受信エラーの回数の出力
+static void consdrv_stat(struct consreg *cons)
+{
+	INTR_DISABLE;
+	consdrv_stat_put(cons, "send drop: ", cons->send_drop);
+	consdrv_stat_put(cons, "recv drop: ", cons->recv_drop);
+	consdrv_stat_put(cons, "overrun  : ", cons->err_orer);
+	consdrv_stat_put(cons, "framing  : ", cons->err_fer);
+	consdrv_stat_put(cons, "parity   : ", cons->err_per);
+	consdrv_stat_put(cons, "klog drop: ", klog_dropped());
+	INTR_ENABLE;
+}
+
 static int consdrv_command(struct consreg *cons, kz_thread_id_t id, int index, int size, char *command)
 {
+	char buf[12], *p;
+	unsigned long n;
+
 	switch (command[0])
 	{
 	// コンソールドライバの使用開始
 	case CONSDRV_CMD_USE:
-		cons->id = id;
-		cons->index = command[1] - '0';
+		// 使用中のコンソールを別のスレッドが使おうとした
+		if (cons->id)
+			return -1;
 		// 送信バッファ獲得
-		cons->send_buf = kz_kmalloc(CONS_BUFFER_SIZE);
+		// 大きなバッファなのでDRAMから獲得する（DRAMが無ければ内蔵RAMのヒープから）
+		cons->send_buf = kz_kmalloc_dram(CONSDRV_SEND_BUFFER_SIZE);
 		// 受信バッファ獲得
-		cons->recv_buf = kz_kmalloc(CONS_BUFFER_SIZE);
-		cons->send_len = 0;
+		cons->recv_buf = kz_kmalloc_dram(CONSDRV_RECV_BUFFER_SIZE);
+		if (!cons->send_buf || !cons->recv_buf)
+		{
+			// 獲得できなかったらこのコンソールは使わない
+			if (cons->send_buf)
+				kz_kmfree(cons->send_buf);
+			if (cons->recv_buf)
+				kz_kmfree(cons->recv_buf);
+			return -1;
+		}
+		cons->id = id;
+		// コンソールの番号とシリアルの番号は同じ
+		cons->index = index;
+		cons->send_head = 0;
+		cons->send_tail = 0;
 		cons->recv_len = 0;
+		cons->writer = 0;
+		cons->send_drop = 0;
+		cons->recv_drop = 0;
+		cons->dma_len = 0;
+		cons->raw_chunk = 0;
+		cons->flow = CONSDRV_FLOW_NONE;
+		cons->flow_state = 0;
+		cons->flow_char = 0;
+		cons->err_orer = 0;
+		cons->err_fer = 0;
+		cons->err_per = 0;
 		// シリアルの初期化
 		serial_init(cons->index);
 		// シリアル受信割り込みを有効にする
 		serial_intr_recv_enable(cons->index);
+		// 使用開始前に溜まっていたカーネルのログを送る
+		INTR_DISABLE;
+		klog_pull(cons);
+		send_start(cons);
+		INTR_ENABLE;
 		break;
 	// コンソールへの文字列出力
 	case CONSDRV_CMD_WRITE:
@@ -247,11 +856,64 @@ static int consdrv_command(struct consreg *cons, kz_thread_id_t id, int index, i
 			send_string()では送信バッファを操作しており再入不可なので、
 			排他のために割り込み禁止にして呼び出す
 		*/
+		// 使用開始していないコンソール（バッファが無い）
+		if (!cons->id)
+			break;
 		// 『送信バッファの排他』を保障
+		// 送信バッファが一杯なら，空くまでこのスレッドがスリープする（その間は他のコマンドを受け付けない）
 		INTR_DISABLE;
-		send_string(cons, command + 1, size - 1);
+		send_string(cons, command + 1, size - 1, 1);
 		INTR_ENABLE;
 		break;
+	// rawモードの設定（"通知するバイト数,タイムアウトのミリ秒"．バイト数が0なら行単位のモードに戻す）
+	case CONSDRV_CMD_RAW:
+		if (!cons->id)
+			break;
+		consdrv_param(buf, sizeof(buf), command + 1, size - 1);
+		for (p = buf; *p && *p != ','; p++)
+			;
+		INTR_DISABLE;
+		timer_cancel(index);
+		cons->raw_chunk = atoul(buf);
+		if (cons->raw_chunk > CONSDRV_RAW_BUFFER_SIZE)
+			cons->raw_chunk = CONSDRV_RAW_BUFFER_SIZE;
+		cons->raw_timeout = *p ? atoul(p + 1) : CONSDRV_RAW_TIMEOUT;
+		cons->raw_head = cons->raw_sent = cons->raw_tail = 0;
+		cons->recv_len = 0;
+		INTR_ENABLE;
+		break;
+	// rawモードで通知された受信データの解放（処理し終えたバイト数．通知された順に返すこと）
+	// 通知していない分まで解放すると，まだ渡していないデータを上書きしてしまうので無視する
+	case CONSDRV_CMD_RELEASE:
+		if (!cons->id)
+			break;
+		n = atoul(consdrv_param(buf, sizeof(buf), command + 1, size - 1));
+		INTR_DISABLE;
+		if (n <= (unsigned int)(cons->raw_sent - cons->raw_head))
+			cons->raw_head += n;
+		flow_rx_check(cons);
+		INTR_ENABLE;
+		break;
+	// ボーレートの変更
+	case CONSDRV_CMD_BAUD:
+		if (!cons->id)
+			break;
+		INTR_DISABLE;
+		consdrv_baud(cons, command + 1, size - 1);
+		INTR_ENABLE;
+		break;
+	// フロー制御の方式の変更
+	case CONSDRV_CMD_FLOW:
+		if (!cons->id)
+			break;
+		consdrv_flow(cons, command[1]);
+		break;
+	// 捨てた文字数と受信エラーの回数の出力
+	case CONSDRV_CMD_STAT:
+		if (!cons->id)
+			break;
+		consdrv_stat(cons);
+		break;
 	default:
 		break;
 	}
@@ -269,7 +931,20 @@ int consdrv_main(int argc, char *argv[])
 	consdrv_init();
 	// 割り込みハンドラを登録
 	// これにより知り合う送信・受信割込みの発生時には、割込みハンドラとしてconsdrv_intr()が呼ばれる
-	kz_setintr(SOFTVEC_TYPE_SERINTR, consdrv_intr);
+	// 受信エラー・受信・送信の割込みをチャネルごとに登録する（送信終了割込みは使わない）
+	for (index = 0; index < CONSDRV_DEVICE_NUM; index++)
+	{
+		kz_setintr(SOFTVEC_TYPE_SCI(index, SOFTVEC_TYPE_SCI_ERI), consdrv_intr);
+		kz_setintr(SOFTVEC_TYPE_SCI(index, SOFTVEC_TYPE_SCI_RXI), consdrv_intr);
+		kz_setintr(SOFTVEC_TYPE_SCI(index, SOFTVEC_TYPE_SCI_TXI), consdrv_intr);
+		// rawモードのタイムアウト用のタイマ（チャネルはコンソールの番号と同じ）
+		kz_setintr(SOFTVEC_TYPE_TMR_CMIA(index), consdrv_timer_intr);
+	}
+	// RTS/CTSでCTSが戻ったかを調べるタイマ
+	kz_setintr(SOFTVEC_TYPE_TMR_CMIA(CONS_FLOW_TIMER), consdrv_timer_intr);
+#ifdef CONSDRV_DMA
+	kz_setintr(SOFTVEC_TYPE_DEND0A, consdrv_dma_intr);
+#endif
 
 	while (1)
 	{
@@ -277,7 +952,8 @@ int consdrv_main(int argc, char *argv[])
 		id = kz_recv(MSGBOX_ID_CONSOUTPUT, &size, &p);
 		index = p[0] - '0';
 		// コマンド処理を呼び出す
-		consdrv_command(&consreg[index], id, index, size - 1, p + 1);
+		if (index >= 0 && index < CONSDRV_DEVICE_NUM)
+			consdrv_command(&consreg[index], id, index, size - 1, p + 1);
 		kz_kmfree(p);
 	}
 
@@ -1,11 +1,67 @@
 #ifndef _CONSDRV_H_INCLUDED_
 #define _CONSDRV_H_INCLUDED_
 
-// コンソールの個数
-#define CONSDRV_DEVICE_NUM 1
+// コンソールの個数（SCI0〜SCI2をそれぞれ独立したコンソールとして使える）
+// コンソールの番号とシリアルの番号は同じにする
+#define CONSDRV_DEVICE_NUM 3
+
+// コンソールのバッファサイズ（Makefileの-Dで変更できる）
+// 送信バッファはリングバッファなので2の累乗にすること
+#ifndef CONSDRV_SEND_BUFFER_SIZE
+#define CONSDRV_SEND_BUFFER_SIZE 512
+#endif
+// 受信バッファ（一行の最大長．超えた分は捨てる）
+#ifndef CONSDRV_RECV_BUFFER_SIZE
+#define CONSDRV_RECV_BUFFER_SIZE 128
+#endif
+// rawモードの受信リングバッファ（2の累乗にすること）
+#ifndef CONSDRV_RAW_BUFFER_SIZE
+#define CONSDRV_RAW_BUFFER_SIZE 128
+#endif
+// rawモードで受信が途切れたとみなす時間（ミリ秒．最大100）
+#define CONSDRV_RAW_TIMEOUT 10
+
 // コンソールドライバの初期化
 #define CONSDRV_CMD_USE 'u'
 // コンソールへの文字列出力
 #define CONSDRV_CMD_WRITE 'w'
+// ボーレートの変更（パラメータは10進数の文字列）
+#define CONSDRV_CMD_BAUD 'b'
+
+/*
+	rawモード（バイナリのデータを受信する）
+	CONSDRV_CMD_RAWで"バイト数,ミリ秒"を指定すると，エコーバックと改行コード変換をやめ，
+	受信したデータを指定したバイト数ごと，または受信が指定時間途切れた時に，
+	MSGBOX_ID_CONSINPUT0 + シリアル番号のメッセージボックスに通知する．
+	通知されるポインタはコンソールドライバのリングバッファの中を指している（コピーしない）．
+	処理し終えたら，CONSDRV_CMD_RELEASEでそのサイズ（10進数の文字列）を返すこと．kz_kmfree()はしない
+	バイト数に0を指定すると行単位のモードに戻る
+*/
+#define CONSDRV_CMD_RAW 'r'
+#define CONSDRV_CMD_RELEASE 'f'
+
+/*
+	フロー制御
+	CONSDRV_CMD_FLOWのパラメータで方式を選ぶ
+	  'n' : 無し
+	  'x' : XON/XOFF（受信したXON/XOFFはデータとしては通知しない）
+	  'h' : RTS/CTS（ポートBをRTS/CTSに使う．serial.cを参照）
+	受信バッファが3/4まで埋まったら相手の送信を止め，1/4まで空いたら再開させる
+*/
+#define CONSDRV_CMD_FLOW 'x'
+#define CONSDRV_FLOW_NONE 0
+#define CONSDRV_FLOW_XONXOFF 1
+#define CONSDRV_FLOW_RTSCTS 2
+
+// 送信・受信で捨てた文字数と受信エラーの回数をコンソールに出力する
+#define CONSDRV_CMD_STAT 's'
+
+/*
+	スレッドから直接コンソールに出力する（CONSDRV_CMD_WRITEと違いメッセージを使わない）
+	コンソールドライバスレッドを経由せず，呼び出したスレッドが送信バッファに書き込む
+	送信バッファに空きがあればすぐに戻り，一杯の時だけ空くまでスリープする
+	CONSDRV_CMD_USEで使用開始していないコンソールなら-1を返す
+*/
+int kz_cons_write(int index, char *buf, int len);
 
 #endif
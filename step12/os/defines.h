@@ -6,6 +6,7 @@
 
 #define NULL ((void *)0)		// NULLポインタの定義
 #define SERIAL_DEFAULT_DEVICE 1 // 標準のシリアルデバイス
+#define CPU_CLOCK 20000000		// CPUのクロック周波数（水晶振動子を25MHzに入れ替えた場合は25000000）
 
 // ビット幅固の整数型
 typedef unsigned char uint8;
@@ -14,14 +15,18 @@ typedef unsigned long uint32;
 
 typedef uint32 kz_thread_id_t;
 typedef int (*kz_func_t)(int argc, char *argv[]);
-typedef void (*kz_handler_t)(void);
+// 割込みハンドラ（引数は割込みの種別＝ベクタ番号．一つのハンドラを複数のベクタに登録した時に呼び分けられる）
+typedef void (*kz_handler_t)(short type);
 
 // メッセージIDの定義
 typedef enum
 {
 	// コンソールからの入力用
 	// シリアル受信割込みの発生時に割り込みハンドラから受信文字をコマンドスレッドに送信する際に、メッセージボックスとして利用される
-	MSGBOX_ID_CONSINPUT = 0,
+	// SCIのチャネルごとに分ける（MSGBOX_ID_CONSINPUT0 + シリアル番号）
+	MSGBOX_ID_CONSINPUT0 = 0,
+	MSGBOX_ID_CONSINPUT1,
+	MSGBOX_ID_CONSINPUT2,
 	// コンソールへの出力用
 	// コマンドスレッドからコンソールドライバスレッドに文字列の出力依頼を行う際に、メッセージボックスとして利用される
 	MSGBOX_ID_CONSOUTPUT,
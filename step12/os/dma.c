@@ -0,0 +1,81 @@
+// DMAコントローラ用のデバイスドライバの本体
+
+/*
+	H8/3069FのDMAコントローラ（DMAC）の短縮アドレスモードを使って，シリアルの送信データをTDRに書き込む
+		- SCI0の送信データエンプティ（TXI0）でDMACが起動され，1バイト転送するたびにTDREが自動で落ちる
+		- 転送が終わるまでCPUには送信割込みが入らない．全部送り終えたら転送終了割込み（DEND0A）が入る
+	1文字ごとに割込みに入っていたのが，バッファ1回分（最大64Kバイト）ごとになる．
+
+	短縮アドレスモードの起動要因は16ビットタイマ・A/D変換器・SCI0に限られているので，
+	DMAで送信できるのはSCI0だけ（SCI1, SCI2は今まで通り送信割込みで1文字ずつ送る）
+*/
+
+#include "defines.h"
+#include "dma.h"
+
+// DMAC チャネル0A（短縮アドレスモード）のレジスタ
+#define H8_3069F_DMAC0A ((volatile struct h8_3069f_dmac *)0xffff20)
+
+struct h8_3069f_dmac
+{
+	volatile uint32 mar;  // 0xffff20, メモリアドレス（上位8ビットは未使用）
+	volatile uint16 etcr; // 0xffff24, 転送回数（I/Oモード）
+	volatile uint8 ioar;  // 0xffff26, I/Oアドレスの下位8ビット（上位は0xffff固定）
+	volatile uint8 dtcr;  // 0xffff27, コントロール
+};
+
+// DTCRの各ビットの定義（短縮アドレスモード）
+#define H8_3069F_DMAC_DTCR_DTS_TXI0 (4 << 0) // 起動要因: SCI0の送信データエンプティ
+#define H8_3069F_DMAC_DTCR_DTIE (1 << 3)	 // 転送終了割込み有効
+#define H8_3069F_DMAC_DTCR_RPE (1 << 4)		 // リピートモード（0ならI/Oモード）
+#define H8_3069F_DMAC_DTCR_DTID (1 << 5)	 // MARを減らす（0なら増やす）
+#define H8_3069F_DMAC_DTCR_DTSZ (1 << 6)	 // ワード転送（0ならバイト転送）
+#define H8_3069F_DMAC_DTCR_DTE (1 << 7)		 // 転送許可（転送が終わると0に戻る）
+
+// SCI0のTDR（0xffffb3）の下位8ビット
+#define H8_3069F_SCI0_TDR 0xb3
+
+// どこから？
+// 『consdrv.c』の『consdrv_init関数』
+int dma_init(void)
+{
+	H8_3069F_DMAC0A->dtcr = 0;
+	return 0;
+}
+
+// どこから？
+// 『consdrv.c』の『send_dma関数』
+// bufからlenバイトをSCI0に送信する．呼び出し側で送信割込み（TIE）を有効にすると転送が始まる
+int dma_send_start(int index, char *buf, int len)
+{
+	volatile struct h8_3069f_dmac *dmac = H8_3069F_DMAC0A;
+
+	if (index != DMA_SERIAL_INDEX || !len)
+		return -1;
+
+	// 設定する前に止める
+	dmac->dtcr = 0;
+	dmac->mar = (uint32)buf;
+	dmac->ioar = H8_3069F_SCI0_TDR;
+	dmac->etcr = len;
+	// I/Oモード，バイト転送，MARは増やす，終わったら割込み
+	dmac->dtcr = H8_3069F_DMAC_DTCR_DTE | H8_3069F_DMAC_DTCR_DTIE | H8_3069F_DMAC_DTCR_DTS_TXI0;
+
+	return 0;
+}
+
+int dma_is_busy(int index)
+{
+	if (index != DMA_SERIAL_INDEX)
+		return 0;
+	return (H8_3069F_DMAC0A->dtcr & H8_3069F_DMAC_DTCR_DTE) ? 1 : 0;
+}
+
+// どこから？
+// 『consdrv.c』の『consdrv_dma_intr関数』
+// 転送終了割込みはDTE=0かつDTIE=1の間ずっと要求され続けるので，割込みの中でDTIEを落とす
+void dma_send_end(int index)
+{
+	if (index == DMA_SERIAL_INDEX)
+		H8_3069F_DMAC0A->dtcr = 0;
+}
@@ -0,0 +1,14 @@
+// DMAコントローラ用のデバイスドライバのヘッダファイル
+
+#ifndef _DMA_H_INCLUDED_
+#define _DMA_H_INCLUDED_
+
+// DMAで送信できるシリアル（短縮アドレスモードの起動要因にできるのはSCI0だけ）
+#define DMA_SERIAL_INDEX 0
+
+int dma_init(void);									  // DMAコントローラの初期化
+int dma_send_start(int index, char *buf, int len); // シリアル送信のDMA転送を開始
+int dma_is_busy(int index);							  // DMA転送中か？
+void dma_send_end(int index);						  // 転送終了割込みの解除
+
+#endif
@@ -0,0 +1,76 @@
+// 外部DRAM用のデバイスドライバの本体
+
+/*
+	H8/3069Fはバスコントローラの中にDRAMコントローラを持っているので，
+	レジスタを設定するだけで，エリア2（0x400000〜）にDRAMを普通のメモリとして見せられる．
+		1. アドレスバスとチップセレクトのポートを出力にする
+		2. エリア2のバス幅を16ビットにする
+		3. エリア2をDRAM空間に設定し，リフレッシュを開始する
+	リフレッシュが回り始めるまではアクセスしてはいけないので，少し待つ．
+*/
+
+#include "defines.h"
+#include "dram.h"
+
+// バスコントローラのレジスタ
+#define H8_3069F_ABWCR ((volatile uint8 *)0xfee020)	 // バス幅（ビットが0のエリアは16ビット）
+#define H8_3069F_DRCRA ((volatile uint8 *)0xfee026)	 // DRAMにするエリアの指定
+#define H8_3069F_DRCRB ((volatile uint8 *)0xfee027)	 // アドレスのマルチプレクス・リフレッシュ
+#define H8_3069F_RTMCSR ((volatile uint8 *)0xfee028) // リフレッシュタイマのクロック
+#define H8_3069F_RTCOR ((volatile uint8 *)0xfee02a)	 // リフレッシュ周期
+
+// ポートの入出力方向
+#define H8_3069F_P1DDR ((volatile uint8 *)0xfee000) // A0-A7
+#define H8_3069F_P2DDR ((volatile uint8 *)0xfee001) // A8-A15
+#define H8_3069F_P8DDR ((volatile uint8 *)0xfee007) // CS0-CS3
+
+// どこから？
+// 『bootload/main.c』の『init関数』（OSはブートローダーが初期化した状態をそのまま使う）
+int dram_init(void)
+{
+	volatile long i;
+
+	// 1. アドレスバス（A0-A10）とCS2（DRAMのRAS）を出力にする
+	*H8_3069F_P1DDR = 0xff;
+	*H8_3069F_P2DDR = 0x07;
+	*H8_3069F_P8DDR = 0xe4;
+
+	// 2. エリア2だけ16ビットバス
+	*H8_3069F_ABWCR = 0xfb;
+
+	// 3. リフレッシュの周期を設定してから，エリア2をDRAMにする
+	*H8_3069F_RTCOR = 7;
+	*H8_3069F_RTMCSR = 0x37;
+	*H8_3069F_DRCRB = 0x98; // 列アドレス9ビット，リフレッシュ有効
+	*H8_3069F_DRCRA = 0x30; // エリア2をDRAM空間に，バーストアクセス有効
+
+	// DRAMはリフレッシュが数回回るまで使えないので待つ
+	for (i = 0; i < 1000; i++)
+		;
+
+	return 0;
+}
+
+// どこから？
+// 『bootload/main.c』の『init関数』，『os/memory.c』の『kzmem_init関数』
+// DRAMに書いた値が読めるか確認する
+// 先頭・中間・末尾のワードで確認（アドレス線が全部つながっているかも見る）
+int dram_check(void)
+{
+	volatile uint16 *p;
+	static const unsigned long offset[] = {0, DRAM_SIZE / 2, DRAM_SIZE - 2};
+	int i;
+
+	for (i = 0; i < sizeof(offset) / sizeof(*offset); i++)
+	{
+		p = (volatile uint16 *)(DRAM_START + offset[i]);
+		*p = 0x5aa5;
+		if (*p != 0x5aa5)
+			return -1;
+		*p = 0xa55a;
+		if (*p != 0xa55a)
+			return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,13 @@
+// 外部DRAMのデバイスドライバのヘッダファイル
+
+#ifndef _DRAM_H_INCLUDED_
+#define _DRAM_H_INCLUDED_
+
+// AKI-H8/3069Fに載っているDRAM（2Mバイト，エリア2）
+#define DRAM_START 0x400000
+#define DRAM_SIZE 0x200000
+
+int dram_init(void);  // バスコントローラとDRAMコントローラの初期化
+int dram_check(void); // 読み書きできるか？（0なら正常）
+
+#endif
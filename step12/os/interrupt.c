@@ -35,7 +35,7 @@ int softvec_setintr(softvec_type_t sof_type, softvec_handler_t handler)
 }
 
 // どこから？
-// 『bootload/intr.S』の『_intr_softerr関数』，『_intr_syscall関数』，『_intr_serintr関数』
+// 『bootload/intr.S』の『_intr_softerr関数』，『_intr_syscall関数』，『_intr_common関数』
 // 共通割込みハンドラ
 // intr.Sから呼ばれていた関数はこれ
 // ソフトウェア割込みベクタのアドレスを見て，各ハンドラに分岐する
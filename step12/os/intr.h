@@ -13,10 +13,25 @@
 // ソフトウェア・割込みベクタの種別の個数
 // なぜ整数で定義するの？
 // -> intr.Sのアセンブラからは，typedefとかenumとかを解釈できないので，整数として定義して使えるようにしている
-#define SOFTVEC_TYPE_NUM 3
+// 割込みベクタの番号（0〜63）をそのまま種別として使う
+// ソフトウェア・割込みベクタ（ハンドラの配列）もベクタ番号で引く．どのベクタの割込みかがハンドラに直接伝わる
+#define SOFTVEC_TYPE_NUM 64
 
-#define SOFTVEC_TYPE_SOFTERR 0 // ソフトウェアエラー
-#define SOFTVEC_TYPE_SYSCALL 1 // システム・コール
-#define SOFTVEC_TYPE_SERINTR 2 // シリアル割込み
+#define SOFTVEC_TYPE_SYSCALL 8 // システム・コール（trapa #0）
+#define SOFTVEC_TYPE_SOFTERR 9 // ソフトウェアエラー（trapa #1〜#3はすべてこの種別で通知する）
+
+// シリアル割込み（SCI0: 52〜55，SCI1: 56〜59，SCI2: 60〜63）
+// チャネルごとに，受信エラー・受信完了・送信データエンプティ・送信終了の順に並んでいる
+#define SOFTVEC_TYPE_SCI_ERI 0 // 受信エラー
+#define SOFTVEC_TYPE_SCI_RXI 1 // 受信完了
+#define SOFTVEC_TYPE_SCI_TXI 2 // 送信データエンプティ
+#define SOFTVEC_TYPE_SCI_TEI 3 // 送信終了
+#define SOFTVEC_TYPE_SCI(index, event) (52 + ((index) << 2) + (event))
+
+// 8ビットタイマのコンペアマッチA割込み（TMR0: 36，TMR1: 38，TMR2: 40，TMR3: 42）
+#define SOFTVEC_TYPE_TMR_CMIA(index) (36 + ((index) << 1))
+
+// DMAコントローラの転送終了割込み（チャネル0A）
+#define SOFTVEC_TYPE_DEND0A 44
 
 #endif
@@ -0,0 +1,119 @@
+// カーネルのログ用リングバッファの本体
+
+#include "defines.h"
+#include "serial.h"
+#include "lib.h"
+#include "klog.h"
+
+#define KLOG_MASK (KLOG_BUFFER_SIZE - 1)
+
+static char klogbuf[KLOG_BUFFER_SIZE];
+// 書き込み位置（カーネルだけが進める）と読み出し位置（コンソールドライバだけが進める）
+// 2の累乗で割った余りを添字にするので，溢れても差は正しく求まる
+static volatile unsigned int klog_head;
+static volatile unsigned int klog_tail;
+static unsigned long klog_drop;
+// 書き込まれた時に呼ぶ関数（コンソールドライバが送信を始めるためのもの）
+static void (*klog_kick)(void);
+// 停止する前に，コンソールドライバの送信バッファに移した分を送り出す関数
+static void (*klog_flush_hook)(void);
+
+// どこから？
+// 『kozos.c』の『thread_exit関数』『softerr_intr関数』など（割込み禁止で呼ばれる）
+// 文字列の書き込み
+// 途中で切れたメッセージが混ざらないように，入りきらない時は丸ごと捨てる
+void klog_puts(char *str)
+{
+	int len = strlen(str);
+	unsigned int tail = klog_tail;
+
+	if (len > KLOG_BUFFER_SIZE - (int)(tail - klog_head))
+	{
+		klog_drop++;
+		return;
+	}
+	while (*str)
+		klogbuf[(tail++) & KLOG_MASK] = *(str++);
+	klog_tail = tail;
+
+	if (klog_kick)
+		klog_kick();
+}
+
+// 整数値を16進数で書き込み
+void klog_putxval(unsigned long value, int column)
+{
+	char buf[9];
+	char *p;
+	p = buf + sizeof(buf) - 1;
+	*(p--) = '\0';
+
+	if (!value && !column)
+		column++;
+
+	while (value || column)
+	{
+		*(p--) = "0123456789abcdef"[value & 0xf];
+		value >>= 4;
+		if (column)
+			column--;
+	}
+
+	klog_puts(p + 1);
+}
+
+// 溜まっているバイト数
+int klog_len(void)
+{
+	return klog_tail - klog_head;
+}
+
+// どこから？
+// 『consdrv.c』の送信割込みの処理
+// 最大sizeバイトを取り出す
+int klog_read(char *buf, int size)
+{
+	unsigned int head = klog_head;
+	int len = klog_tail - head;
+
+	if (len > size)
+		len = size;
+	for (size = 0; size < len; size++)
+		buf[size] = klogbuf[(head++) & KLOG_MASK];
+	klog_head = head;
+
+	return len;
+}
+
+// 捨てたメッセージの数
+unsigned long klog_dropped(void)
+{
+	return klog_drop;
+}
+
+// 書き込まれた時に呼ぶ関数の登録
+void klog_set_kick(void (*kick)(void))
+{
+	klog_kick = kick;
+}
+
+// 停止する前に呼ぶ関数の登録
+void klog_set_flush(void (*flush)(void))
+{
+	klog_flush_hook = flush;
+}
+
+// どこから？
+// 『kozos.c』の『kz_sysdown関数』
+// 止まる前に残りをすべて出す（割込みはもう使えないので，ビジーループで送る）
+// ログの前の方はkickでコンソールドライバの送信バッファに移されているので，先にそちらを送り出してもらう
+void klog_flush(void)
+{
+	char c;
+
+	if (klog_flush_hook)
+		klog_flush_hook();
+
+	while (klog_read(&c, 1))
+		serial_send_byte(SERIAL_DEFAULT_DEVICE, c);
+}
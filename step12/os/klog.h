@@ -0,0 +1,29 @@
+// カーネルのログ用リングバッファのヘッダファイル
+
+#ifndef _KOZOS_KLOG_H_INCLUDED_
+#define _KOZOS_KLOG_H_INCLUDED_
+
+// ログのリングバッファのサイズ（2の累乗にすること．Makefileの-Dで変更できる）
+#ifndef KLOG_BUFFER_SIZE
+#define KLOG_BUFFER_SIZE 256
+#endif
+
+/*
+	カーネルの中（割込み禁止）でのメッセージ出力はputs()だとシリアルの送信をビジーループで待つので，
+	9600bpsだと1行で数ミリ秒の間システム全体が止まってしまう
+	代わりにこのリングバッファに書き込むだけにして（シリアルは待たない），
+	コンソールドライバが送信割込みを使って少しずつ送り出す
+	書き込むのはカーネル，読み出すのはコンソールドライバの割込みハンドラだけなので，
+	書き込み位置と読み出し位置をそれぞれ一方だけが進める（ロックは不要）
+*/
+
+void klog_puts(char *str);							  // 文字列の書き込み（入りきらなければ丸ごと捨てて数える）
+void klog_putxval(unsigned long value, int column);	  // 整数値を16進数で書き込み（putxval()と同じ書式）
+int klog_len(void);									  // 溜まっているバイト数
+int klog_read(char *buf, int size);					  // 最大sizeバイトを取り出す（戻り値は取り出したバイト数）
+unsigned long klog_dropped(void);					  // 捨てたメッセージの数
+void klog_set_kick(void (*kick)(void));				  // 書き込まれた時に呼ぶ関数の登録（送信の開始用）
+void klog_set_flush(void (*flush)(void));			  // klog_flush()の最初に呼ぶ関数の登録（送信バッファに移した分の送り出し用）
+void klog_flush(void);								  // 溜まっている分をビジーループで送り出す（停止する直前用）
+
+#endif
@@ -5,6 +5,7 @@
 #include "syscall.h"
 #include "lib.h"
 #include "memory.h"
+#include "klog.h"
 
 // スレッドの最大個数
 #define THREAD_NUM 6
@@ -12,6 +13,8 @@
 #define THREAD_NAME_SIZE 15
 // 優先度の個数
 #define PRIORITY_NUM 16
+// 同時に送信中にできるメッセージの最大数（メッセージバッファのキャッシュの大きさ）
+#define MSGBUF_NUM 16
 
 // スレッドコンテキスト
 // スレッドのコンテキスト保存用の構造体の定義
@@ -50,6 +53,14 @@ typedef struct _kz_thread
 
 	// スレッドのコンテキスト情報の保存領域
 	kz_context context;
+
+	// 動的メモリの使用量（所有しているブロックの合計）
+	// スレッド終了後もTCBが再利用されるまでは残しておき，回収の要否の判断に使う
+	struct
+	{
+		long size; // バイト数
+		int num;   // ブロック数
+	} mem;
 } kz_thread;
 
 // メッセージバッファ
@@ -111,10 +122,15 @@ static kz_handler_t handlers[SOFTVEC_TYPE_NUM]; // OSが管理する割り込み
 // メッセージボックスの実体
 // メッセージIDの個数分用意
 static kz_msgbox msgboxes[MSGBOX_ID_NUM];
+// メッセージバッファ専用のキャッシュ（アプリケーションのメモリ使用量に影響されない）
+static kzmem_cache *msgbuf_cache;
 
 // スレッドのディスパッチ用関数（実態はstartup.sにアセンブラで記述）
 void dispatch(kz_context *context);
 
+// 割込みハンドラの登録（kz_start()とkz_setintr()から使うので先に宣言しておく）
+static int thread_setintr(softvec_type_t sof_type, kz_handler_t handler);
+
 // レディーキューの操作 (リンクリストの操作，ポインタの操作) -----------------------------------------------------------------------------------------
 
 // どこから？
@@ -227,7 +243,8 @@ static void thread_init(kz_thread *thp)
 */
 static kz_thread_id_t thread_run(kz_func_t func, char *name, int priority, int stacksize, int argc, char *argv[])
 {
-	int i;
+	int i, num;
+	long size;
 	kz_thread *thp;
 	uint32 *sp;
 	extern char userstack;					// リンカスクリプトで定義されるスタック領域
@@ -248,8 +265,24 @@ static kz_thread_id_t thread_run(kz_func_t func, char *name, int priority, int s
 	if (i == THREAD_NUM)
 		return -1;
 
+#ifdef KZMEM_RECLAIM
+	// 前にこのTCBを使っていたスレッドが，ブロックを所有したまま終了している
+	// TCBのアドレスがそのまま新しいスレッドのIDになるので，その前にまとめて回収しておく
+	if (thp->mem.num)
+	{
+		kzmem_reclaim((kz_thread_id_t)thp);
+		thp->mem.size = 0;
+		thp->mem.num = 0;
+	}
+#endif
+	// 回収しない場合，残ったブロックは新しいスレッドの所有として引き継ぐ（使用量も引き継ぐ）
+	size = thp->mem.size;
+	num = thp->mem.num;
+
 	// 初期化
 	memset(thp, 0, sizeof(*thp));
+	thp->mem.size = size;
+	thp->mem.num = num;
 	// ゴミが残ってるかもなので0埋め
 	// thpを新規スレッドとして育成
 
@@ -331,9 +364,15 @@ static kz_thread_id_t thread_run(kz_func_t func, char *name, int priority, int s
 // システムコール
 static int thread_exit(void)
 {
-	puts(current->name);
-	puts(" EXIT.\n");
+	long size = current->mem.size;
+	int num = current->mem.num;
+
+	klog_puts(current->name);
+	klog_puts(" EXIT.\n");
 	memset(current, 0, sizeof(*current));
+	// 所有していたブロックの使用量は，TCBが再利用される時の回収のために残しておく
+	current->mem.size = size;
+	current->mem.num = num;
 	return 0;
 }
 
@@ -402,14 +441,78 @@ static int thread_chpri(int priority)
 	return old;
 }
 
+// 動的メモリの所有スレッドの管理 -------------------------------------------------------------------------------------------------
+
+// 所有スレッドを付けて獲得（ownerがNULLならカーネルの所有）
+// dramが0以外なら外部DRAMから獲得する（獲得できなければNULL）
+static void *mem_alloc(kz_thread *owner, long size, int dram)
+{
+	void *p = dram ? kzmem_alloc_dram(size) : kzmem_alloc(size);
+
+	if (p == NULL)
+		return NULL;
+	kzmem_setowner(p, (kz_thread_id_t)owner);
+	if (owner)
+	{
+		owner->mem.size += kzmem_size(p);
+		owner->mem.num++;
+	}
+	return p;
+}
+
+// 所有スレッドを付け替える（メッセージで渡された時）
+static void mem_chown(void *p, kz_thread *owner)
+{
+	kz_thread *old = (kz_thread *)kzmem_owner(p);
+
+	if (old)
+	{
+		old->mem.size -= kzmem_size(p);
+		old->mem.num--;
+	}
+	kzmem_setowner(p, (kz_thread_id_t)owner);
+	if (owner)
+	{
+		owner->mem.size += kzmem_size(p);
+		owner->mem.num++;
+	}
+}
+
+// 所有スレッドの使用量から差し引いて解放
+// 所有スレッドを読む前に，獲得済みのブロックか確かめる
+// （解放済みのヒープのブロックでは，所有スレッドの位置にTLSFの空きリストのポインタが入っている）
+static void mem_free(void *p)
+{
+	if (!kzmem_check(p))
+	{
+#ifdef KZMEM_DEBUG
+		kzmem_free(p); // 二重解放などの原因を表示して停止する
+#endif
+		kz_sysdown();
+		return;
+	}
+	mem_chown(p, NULL);
+	kzmem_free(p);
+}
+
 // どこから？
 // 『call_function関数』
 // 動的メモリ獲得
+// サービスコール（割込みハンドラ）からの場合はcurrentがNULLなので，カーネルの所有になる
 static void *thread_kmalloc(int size)
 {
 	// システムコールを呼び出した関数をレディーキューに戻す
 	putcurrent();
-	return kzmem_alloc(size);
+	return mem_alloc(current, size, 0);
+}
+
+// どこから？
+// 『call_function関数』
+// 外部DRAMから動的メモリ獲得（大きなバッファ用）
+static void *thread_kmalloc_dram(long size)
+{
+	putcurrent();
+	return mem_alloc(current, size, 1);
 }
 
 // どこから？
@@ -418,7 +521,7 @@ static void *thread_kmalloc(int size)
 // charで受け取るんか．．
 static int thread_kmfree(char *p)
 {
-	kzmem_free(p);
+	mem_free(p);
 	putcurrent();
 	return 0;
 }
@@ -426,19 +529,32 @@ static int thread_kmfree(char *p)
 // どこから？
 // 『thread_send関数』
 // 引数として渡されたメッセージボックスに，メッセージを格納
-static void sendmsg(kz_msgbox *mboxp, kz_thread *thp, int size, char *p)
+// メッセージバッファが枯渇していたら-1を返す（送信は行われない）
+static int sendmsg(kz_msgbox *mboxp, kz_thread *thp, int size, char *p)
 {
 	kz_msgbuf *mp;
 
 	// メッセージバッファの作成
-	mp = (kz_msgbuf *)kzmem_alloc(sizeof(*mp));
+	mp = (kz_msgbuf *)kzmem_cache_alloc(msgbuf_cache);
 	if (mp == NULL)
-		kz_sysdown();
+	{
+		// 最初の１回だけ知らせる（2回目以降は回数だけ数える）
+		if (kzmem_cache_fail(msgbuf_cache) == 1)
+		{
+			klog_puts(kzmem_cache_name(msgbuf_cache));
+			klog_puts(" cache exhausted.\n");
+		}
+		return -1;
+	}
 	mp->next = NULL;
 	mp->sender = thp;
 	mp->param.size = size;
 	mp->param.p = p;
 
+	// 送信したブロックは，受信されるまではどのスレッドの所有でもない（送信元が終了しても回収されない）
+	if (p && kzmem_check(p))
+		mem_chown(p, NULL);
+
 	// メッセージボックスの末尾にメッセージを接続
 	if (mboxp->tail)
 	{
@@ -449,6 +565,8 @@ static void sendmsg(kz_msgbox *mboxp, kz_thread *thp, int size, char *p)
 		mboxp->head = mp;
 	}
 	mboxp->tail = mp;
+
+	return 0;
 }
 
 // どこから？
@@ -474,11 +592,15 @@ static void recvmsg(kz_msgbox *mboxp)
 	if (p->un.recv.pp)
 		*(p->un.recv.pp) = mp->param.p;
 
+	// 受信したブロックの所有権は受信したスレッドに移る
+	if (mp->param.p && kzmem_check(mp->param.p))
+		mem_chown(mp->param.p, mboxp->receiver);
+
 	// 受信待ちスレッドはいなくなったので，NULLに戻す
 	mboxp->receiver = NULL;
 
 	// メッセージバッファの解放
-	kzmem_free(mp);
+	kzmem_cache_free(msgbuf_cache, mp);
 }
 
 // どこから？
@@ -492,7 +614,9 @@ static int thread_send(kz_msgbox_id_t id, int size, char *p)
 	// 送信システムコールを発行したスレッドは，もう用はないからレディーキューに戻す
 	putcurrent();
 	// メッセージを送信
-	sendmsg(mboxp, current, size, p);
+	// 送信できなかった場合，渡そうとした領域は送信元の所有のまま（送信元で解放する）
+	if (sendmsg(mboxp, current, size, p) < 0)
+		return -1;
 
 	// 送信対象のメッセージボックスで，受信待ちしているスレッドがいる場合，そちらを優先して受信処理を行う
 	if (mboxp->receiver)
@@ -586,6 +710,12 @@ void call_kmalloc(kz_syscall_param_t *p)
 	p->un.kmalloc.ret = thread_kmalloc(p->un.kmalloc.size);
 }
 
+// kz_kmalloc_dram()
+void call_kmalloc_dram(kz_syscall_param_t *p)
+{
+	p->un.kmalloc.ret = thread_kmalloc_dram(p->un.kmalloc.size);
+}
+
 // kz_kmfree()
 void call_kmfree(kz_syscall_param_t *p)
 {
@@ -623,7 +753,8 @@ void (*functions[])(kz_syscall_param_t *p) = {
 	call_kmfree,
 	call_send,
 	call_recv,
-	call_setintr};
+	call_setintr,
+	call_kmalloc_dram};
 
 // 関数のポインタの配列を利用して，(明示的に)テーブル参照することで，リアルタイム性を確保
 static void call_function(kz_syscall_type_t sys_type, kz_syscall_param_t *p)
@@ -698,7 +829,7 @@ static void syscall_proc(kz_syscall_type_t sys_type, kz_syscall_param_t *p)
 // どこから？
 // 『kozos.c』の『thread_intr関数』（handlers[sof_type]()）
 // 割り込みハンドラ
-static void syscall_intr(void)
+static void syscall_intr(short type)
 {
 	syscall_proc(current->syscall.type, current->syscall.param);
 }
@@ -715,7 +846,7 @@ static void srvcall_proc(kz_syscall_type_t type, kz_syscall_param_t *p)
 		呼び出し後に， thread_intr()でスケジューリング処理が行われ， current は再設定される．
 	*/
 	current = NULL;
-	call_functions(type, p);
+	call_function(type, p);
 }
 
 // どこから？
@@ -743,10 +874,10 @@ static void schedule(void)
 // どこから？
 // 『kozos.c』の『thread_intr関数』（handlers[sof_type]()）
 // 割り込みハンドラ
-static void softerr_intr(void)
+static void softerr_intr(short type)
 {
-	puts(current->name);
-	puts(" DOWN.\n");
+	klog_puts(current->name);
+	klog_puts(" DOWN.\n");
 	getcurrent();  // このソフトエラー割込みを呼び出したスレッド（current）をレディーキューから外す
 	thread_exit(); // スレッド終了
 }
@@ -763,7 +894,7 @@ static void thread_intr(softvec_type_t sof_type, unsigned long sp)
 	// syscall_intr, softerr_intr （システムコール，ソフトウェアエラー）
 	// それ以外の場合は，『kz_setintrによってユーザ登録されたハンドラ』が実行される．
 	if (handlers[sof_type])
-		handlers[sof_type]();
+		handlers[sof_type](sof_type);
 
 	// レディーキューの先頭をカレントスレッドとしてcurrentに代入（ラウンドロビン）
 	// 次の実行するスレッドがレディーキューになかったらここで処理が終わる．
@@ -804,6 +935,10 @@ void kz_start(kz_func_t func, char *name, int priority, int stacksize, int argc,
 {
 	// メモリプールの初期化
 	kzmem_init();
+	// カーネル内部で使う構造体のキャッシュを作成（アプリケーション用のプールとは別に確保しておく）
+	msgbuf_cache = kzmem_cache_create("msgbuf", sizeof(kz_msgbuf), MSGBUF_NUM);
+	if (msgbuf_cache == NULL)
+		kz_sysdown();
 
 	// カレントスレッドの初期化
 	current = NULL;
@@ -848,10 +983,50 @@ void kz_start(kz_func_t func, char *name, int priority, int stacksize, int argc,
 	// 『startup.s』に書かれている
 }
 
+#ifdef KZMEM_DEBUG
+// どこから？
+// 『memory.c』の『kzmem_debug_alloc関数』『kzmem_debug_free関数』
+// メモリ破壊の原因（どのスレッドが，どこから呼んだか）を表示して停止する
+void kz_memfault(char *reason, void *mem)
+{
+	kz_syscall_param_t *p;
+	void *caller = NULL;
+
+	klog_puts("kzmem: ");
+	klog_puts(reason);
+	klog_puts(" (");
+	klog_putxval((unsigned long)mem, 0);
+	klog_puts(")\n");
+
+	// サービスコール（割込みハンドラ）から呼ばれた場合は，currentはNULL
+	if (current)
+	{
+		p = current->syscall.param;
+		if (current->syscall.type == KZ_SYSCALL_TYPE_KMALLOC || current->syscall.type == KZ_SYSCALL_TYPE_KMALLOC_DRAM)
+			caller = p->un.kmalloc.caller;
+		else if (current->syscall.type == KZ_SYSCALL_TYPE_KMFREE)
+			caller = p->un.kmfree.caller;
+		klog_puts("thread: ");
+		klog_puts(current->name);
+	}
+	else
+	{
+		klog_puts("thread: (interrupt)");
+	}
+	klog_puts(" caller: ");
+	klog_putxval((unsigned long)caller, 0);
+	klog_puts("\n");
+
+	kz_sysdown();
+}
+#endif
+
 // どこから？
 // 『kozos.c』の『schedule関数』
 void kz_sysdown(void)
 {
+	// 停止すると送信割込みではもう送れないので，溜まっているログはここで送り出す
+	klog_flush();
 	puts("system error!\n");
 	while (1)
 		;
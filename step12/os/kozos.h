@@ -33,6 +33,8 @@ kz_thread_id_t kz_getid(void);
 int kz_chpri(int priority);
 // 領域を確保
 void *kz_kmalloc(int size);
+// 外部DRAMから領域を確保（大きなバッファ用）
+void *kz_kmalloc_dram(long size);
 // 領域を解放
 int kz_kmfree(void *p);
 // メッセージ送信
@@ -99,6 +99,67 @@ int strncmp(const char *s1, const char *s2, int len)
 	return 0;
 }
 
+// 数値--------------------------------------------------------------------
+
+// 32ビットの割り算（商を返し，余りを*remに入れる．remはNULLでもよい）
+// H8/300Hの除算命令は32÷16ビットまでで，それ以上はlibgccの関数が呼ばれる．
+// libgccはリンクしていない（-nostdlib）ので，シフトと引き算で自前で計算する
+unsigned long udivmod(unsigned long n, unsigned long d, unsigned long *rem)
+{
+	unsigned long q = 0, r = 0;
+	int i;
+
+	for (i = 31; i >= 0; i--)
+	{
+		r = (r << 1) | ((n >> i) & 1);
+		if (r >= d)
+		{
+			r -= d;
+			q |= 1UL << i;
+		}
+	}
+	if (rem)
+		*rem = r;
+
+	return q;
+}
+
+// 10進数の文字列を数値に変換（数字以外の文字で終わる）
+unsigned long atoul(const char *s)
+{
+	unsigned long value = 0;
+
+	while (*s >= '0' && *s <= '9')
+	{
+		// value * 10（掛け算もlibgccになるのでシフトで）
+		value = (value << 3) + (value << 1) + (*(s++) - '0');
+	}
+
+	return value;
+}
+
+// 数値を10進数の文字列に変換（bufには11バイト必要）．文字列の長さを返す
+int ultostr(unsigned long value, char *buf)
+{
+	char tmp[10];
+	unsigned long r;
+	int i = 0, len;
+
+	do
+	{
+		value = udivmod(value, 10, &r);
+		tmp[i++] = '0' + r;
+	} while (value);
+
+	// 下の桁から求まるので逆順にコピー
+	len = i;
+	while (i)
+		*(buf++) = tmp[--i];
+	*buf = '\0';
+
+	return len;
+}
+
 // 入出力--------------------------------------------------------------------
 
 // 1文字送信
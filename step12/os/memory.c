@@ -2,6 +2,8 @@
 #include "kozos.h"
 #include "lib.h"
 #include "memory.h"
+#include "tlsf.h"
+#include "dram.h"
 
 /*
 	メモリ・ヘッダ
@@ -13,10 +15,29 @@ typedef struct _kzmem_block
 {
 	// 次のメモリ領域のポインタ
 	struct _kzmem_block *next;
+	// 所有スレッド（獲得したスレッド．メッセージで渡されたら受信したスレッドに移る．0ならカーネル）
+	// スレッド終了時に，このスレッドが所有したままのブロックを回収するのに使う
+	kz_thread_id_t owner;
 	// ブロックがどのプールに所属するか，情報を持たせておく．メモリ解放の時に使う
 	int size;
+#ifdef KZMEM_DEBUG
+	// データ領域の直前のガード（獲得中と解放済みで値を変えて，二重解放とヘッダの破壊を検出する）
+	uint16 magic;
+#endif
 } kzmem_block;
 
+#ifdef KZMEM_DEBUG
+#define KZMEM_MAGIC_USED 0xa55a // 獲得中
+#define KZMEM_MAGIC_FREE 0xdead // 解放済み
+// データ領域の直後に置くガード（レッドゾーン）．書き込みがはみ出したら値が壊れる
+#define KZMEM_REDZONE_SIZE 4
+#define KZMEM_REDZONE 0xfd
+// 解放済みの領域を埋める値（解放後に書き込まれたら，次の獲得時に分かる）
+#define KZMEM_POISON 0xdd
+#else
+#define KZMEM_REDZONE_SIZE 0
+#endif
+
 /*
 	メモリ・プールの構造体
 	ブロックサイズ（16, 32, 64）ごとに確保される
@@ -36,28 +57,101 @@ typedef struct _kzmem_pool
 // メモリ・プールの定義（個々のヘッダ・サイズ・個数）
 // ３種類定義（16, 32, 64 バイト）
 // あらかじめ静的に確保する領域
+#ifdef KZMEM_DEBUG
+// デバッグ時はヘッダとレッドゾーンの分だけ一回り大きくする（16バイトではデータ領域が残らない）
+static kzmem_pool pool[] = {
+	{32, 8, NULL},
+	{64, 8, NULL},
+	{128, 4, NULL},
+};
+#else
 static kzmem_pool pool[] = {
 	{16, 8, NULL},
 	{32, 8, NULL},
 	{64, 4, NULL},
 };
+#endif
 
 // メモリ・プールの種類の個数（今回は３種類）
 #define MEMORY_AREA_NUM (sizeof(pool) / sizeof(*pool))
 
+// 可変長ヒープから獲得したブロックのヘッダに入れるサイズ（どのプールのサイズとも一致しない値）
+#define KZMEM_SIZE_HEAP (-1)
+// DRAMのヒープから獲得したブロック
+#define KZMEM_SIZE_DRAM (-2)
+
+// 可変長ヒープ（プールに切り分けた残りの領域をTLSFで管理する）
+// 64バイトを超える要求と，プールが枯渇した時の受け皿になる
+static tlsf_control *heap;
+// プールとヒープの境界（ポインタがどちらの領域のものか判定するのに使う）
+static char *pool_end;
+
+// 外部DRAMのヒープ（2Mバイトを丸ごとTLSFで管理する）
+// 内蔵RAMより遅いので，XMODEMの受信バッファやトレース用のバッファ，大きなメッセージなどの大容量の領域に使う
+// カーネルのデータとスタックは内蔵RAMに置いたままにする
+// DRAMが使えない（初期化されていない）場合はNULL
+static tlsf_control *dram_heap;
+
+#ifdef KZMEM_DEBUG
+// 獲得時のガードの設定（レッドゾーンはデータ領域の末尾に置く）
+static void kzmem_debug_alloc(kzmem_block *mp)
+{
+	long size = kzmem_size(mp + 1);
+
+	// 解放後に書き込まれていないか（プールのブロックのみ．ヒープは空きリストと結合で上書きされるので見ない）
+	if (mp->size > 0)
+	{
+		unsigned char *p = (unsigned char *)(mp + 1);
+		long i;
+		for (i = 0; i < size + KZMEM_REDZONE_SIZE; i++)
+		{
+			if (p[i] != KZMEM_POISON)
+				kz_memfault("use after free", mp + 1);
+		}
+	}
+
+	mp->magic = KZMEM_MAGIC_USED;
+	memset((char *)(mp + 1) + size, KZMEM_REDZONE, KZMEM_REDZONE_SIZE);
+}
+
+// 解放時のガードの検査と，解放する領域の毒埋め
+static void kzmem_debug_free(kzmem_block *mp)
+{
+	unsigned char *p;
+	long size;
+	int i;
+
+	// 解放済みのヒープのブロックはkzmem_check()でも弾かれるので，先にガードで二重解放かを見る
+	if (mp->magic == KZMEM_MAGIC_FREE)
+		kz_memfault("double free", mp + 1);
+	if (!kzmem_check(mp + 1))
+		kz_memfault("foreign pointer", mp + 1);
+	if (mp->magic != KZMEM_MAGIC_USED)
+		kz_memfault("header corrupted", mp + 1);
+
+	size = kzmem_size(mp + 1);
+	p = (unsigned char *)(mp + 1) + size;
+	for (i = 0; i < KZMEM_REDZONE_SIZE; i++)
+	{
+		if (p[i] != KZMEM_REDZONE)
+			kz_memfault("buffer overrun", mp + 1);
+	}
+
+	mp->magic = KZMEM_MAGIC_FREE;
+	memset(mp + 1, KZMEM_POISON, size + KZMEM_REDZONE_SIZE);
+}
+#endif
+
 // どこから？
 // 『kzmem_init関数』
 // メモリプールの初期化
-static int kzmem_init_pool(kzmem_pool *p)
+// 切り分けに使った後の領域の先頭を返す
+static char *kzmem_init_pool(kzmem_pool *p, char *area)
 {
 	int i;
 	kzmem_block *mp;
 	// 『ポインタ変数のアドレス』を格納
 	kzmem_block **mpp;
-	// リンカスクリプトで定義されている動的メモリ用の領域を取得
-	extern char freearea;
-	// 静的に保持
-	static char *area = &freearea;
 
 	// 切り分け
 	mp = (kzmem_block *)area;
@@ -89,6 +183,11 @@ static int kzmem_init_pool(kzmem_pool *p)
 		// ③『格納後に初期化』 (ヘッダだけ初期化してないか？, mp+p->size分の初期化はしていないはず．．)
 		memset(mp, 0, sizeof(*mp));
 		mp->size = p->size;
+#ifdef KZMEM_DEBUG
+		// 解放済みの状態にしておく
+		mp->magic = KZMEM_MAGIC_FREE;
+		memset(mp + 1, KZMEM_POISON, p->size - sizeof(*mp));
+#endif
 		// 解放済みリンクリストの次
 		// ① 『まずアドレスを決める』
 		mpp = &(mp->next);
@@ -99,7 +198,7 @@ static int kzmem_init_pool(kzmem_pool *p)
 		area += p->size;
 	}
 
-	return 0;
+	return area;
 }
 
 // どこから？
@@ -108,11 +207,28 @@ static int kzmem_init_pool(kzmem_pool *p)
 int kzmem_init(void)
 {
 	int i;
+	// リンカスクリプトで定義されている動的メモリ用の領域を取得
+	// freeareaからスレッドのスタック領域（userstack）の手前までが使える
+	extern char freearea, userstack, dramarea;
+	char *area = &freearea;
+
 	for (i = 0; i < MEMORY_AREA_NUM; i++)
 	{
 		// 各メモリプールを初期化
-		kzmem_init_pool(&pool[i]);
+		area = kzmem_init_pool(&pool[i], area);
 	}
+
+	// 残りはすべて可変長ヒープにする
+	pool_end = area;
+	heap = tlsf_create(area, (long)&userstack - (long)area);
+	if (heap == NULL)
+		kz_sysdown();
+
+	// DRAMはブートローダーが初期化しているので，読み書きできればヒープにする
+	// （リンカスクリプトのdram領域の先頭から）
+	if (!dram_check())
+		dram_heap = tlsf_create(&dramarea, DRAM_START + DRAM_SIZE - (long)&dramarea);
+
 	return 0;
 }
 
@@ -132,15 +248,12 @@ void *kzmem_alloc(int size)
 		p = &pool[i];
 		// 要求されたサイズが収まるかチェック
 		// 用意したメモリプールサイズ - メモリヘッダ
-		if (size <= p->size - sizeof(kzmem_block))
+		if (size <= p->size - sizeof(kzmem_block) - KZMEM_REDZONE_SIZE)
 		{
 			// 解放済み領域がない（メモリブロック不足）
+			// -> 可変長ヒープから獲得する
 			if (p->free == NULL)
-			{
-				// メモリ枯渇
-				kz_sysdown();
-				return NULL;
-			}
+				break;
 			// 解放済みリンクリストから領域を取得
 			mp = p->free;
 			// リンクリストの更新（先頭を変える）
@@ -149,6 +262,11 @@ void *kzmem_alloc(int size)
 			// リンクリストから抜き出したmpはnextを持たない
 			// 安全のためにNULLクリア
 			mp->next = NULL;
+			// 所有スレッドは獲得後にカーネルが設定する（kzmem_setowner()）
+			mp->owner = 0;
+#ifdef KZMEM_DEBUG
+			kzmem_debug_alloc(mp);
+#endif
 
 			// 実際に利用可能な領域は，メモリブロック構造体（メモリヘッダ）の直後の領域になる．
 			// ので直後のアドレスを返す．
@@ -157,10 +275,55 @@ void *kzmem_alloc(int size)
 		}
 	}
 
-	// 指定されたサイズの領域を格納できるメモリプールが無い
-	// 64より大きい
-	kz_sysdown();
-	return NULL;
+	// 指定されたサイズの領域を格納できるメモリプールが無い（64より大きい），またはプールが枯渇している
+	// -> 可変長ヒープから獲得する．プールと同じメモリ・ヘッダを先頭に付けておく
+	mp = tlsf_malloc(heap, (long)size + sizeof(kzmem_block) + KZMEM_REDZONE_SIZE);
+	if (mp == NULL)
+	{
+		// メモリ枯渇
+		kz_sysdown();
+		return NULL;
+	}
+	mp->next = NULL;
+	mp->owner = 0;
+	mp->size = KZMEM_SIZE_HEAP;
+#ifdef KZMEM_DEBUG
+	kzmem_debug_alloc(mp);
+#endif
+
+	return mp + 1;
+}
+
+// どこから？
+// 『kozos.c』の『thread_kmalloc_dram関数』
+// DRAMから動的メモリを確保（大きな領域向け．プールは使わない）
+// 大きな領域は獲得できないこともあり得るので，枯渇してもシステムは止めずにNULLを返す
+// DRAMが無い時は内蔵RAMのヒープから獲得する
+void *kzmem_alloc_dram(long size)
+{
+	kzmem_block *mp;
+
+	if (dram_heap == NULL)
+	{
+		mp = tlsf_malloc(heap, size + sizeof(kzmem_block) + KZMEM_REDZONE_SIZE);
+		if (mp == NULL)
+			return NULL;
+		mp->size = KZMEM_SIZE_HEAP;
+	}
+	else
+	{
+		mp = tlsf_malloc(dram_heap, size + sizeof(kzmem_block) + KZMEM_REDZONE_SIZE);
+		if (mp == NULL)
+			return NULL;
+		mp->size = KZMEM_SIZE_DRAM;
+	}
+	mp->next = NULL;
+	mp->owner = 0;
+#ifdef KZMEM_DEBUG
+	kzmem_debug_alloc(mp);
+#endif
+
+	return mp + 1;
 }
 
 // どこから？
@@ -176,6 +339,26 @@ void kzmem_free(void *mem)
 	// kzmem_blockポインタで『キャスト』してから-1することで，ヘッダの先頭を取得できる．
 	mp = ((kzmem_block *)mem - 1);
 
+#ifdef KZMEM_DEBUG
+	// 二重解放・獲得していないポインタ・はみ出しの検出（見つかったらその場で停止する）
+	kzmem_debug_free(mp);
+#endif
+
+	// 可変長ヒープのブロック（解放済みのブロックはどのスレッドの所有でもない）
+	if (mp->size == KZMEM_SIZE_HEAP)
+	{
+		mp->owner = 0;
+		tlsf_free(heap, mp);
+		return;
+	}
+	// DRAMのヒープのブロック
+	if (mp->size == KZMEM_SIZE_DRAM)
+	{
+		mp->owner = 0;
+		tlsf_free(dram_heap, mp);
+		return;
+	}
+
 	for (i = 0; i < MEMORY_AREA_NUM; i++)
 	{
 		p = &pool[i];
@@ -183,6 +366,8 @@ void kzmem_free(void *mem)
 		if (mp->size == p->size)
 		{
 			// 解放済みリンクリストの先頭につなげる（再利用可能になる）
+			// 解放済みのブロックはどのスレッドの所有でもない
+			mp->owner = 0;
 			// mpの次に今の先頭を
 			mp->next = p->free;
 			// 先頭をmpに更新
@@ -193,3 +378,208 @@ void kzmem_free(void *mem)
 
 	kz_sysdown();
 }
+
+// 所有スレッドの管理 ----------------------------------------------------------------------------------
+
+// どこから？
+// 『kozos.c』の『mem_alloc関数』『mem_chown関数』
+// ブロックの所有スレッドを設定
+void kzmem_setowner(void *mem, kz_thread_id_t owner)
+{
+	((kzmem_block *)mem - 1)->owner = owner;
+}
+
+// ブロックの所有スレッドを取得
+kz_thread_id_t kzmem_owner(void *mem)
+{
+	return ((kzmem_block *)mem - 1)->owner;
+}
+
+// ブロックで実際に利用できるバイト数（要求サイズではなく，切り上げられたブロックの大きさ）
+long kzmem_size(void *mem)
+{
+	kzmem_block *mp = (kzmem_block *)mem - 1;
+
+	if (mp->size < 0)
+		return tlsf_block_size(mp) - sizeof(kzmem_block) - KZMEM_REDZONE_SIZE;
+	return mp->size - sizeof(kzmem_block) - KZMEM_REDZONE_SIZE;
+}
+
+// どこから？
+// 『kozos.c』の『sendmsg関数』『recvmsg関数』
+// kzmemで獲得したブロックを指しているか？
+// メッセージで渡されるポインタは静的な領域のこともあるので，所有権を移す前に確認する
+int kzmem_check(void *mem)
+{
+	int i;
+	extern char freearea, userstack;
+	char *area = &freearea;
+	kzmem_block *mp = (kzmem_block *)mem - 1;
+
+	// ヒープの領域は，ヘッダのサイズだけでは利用者のデータと区別できないので，TLSFのブロックとしても確かめる
+	// （解放済みのブロックもここで弾かれる）
+	if ((char *)mp >= pool_end && (char *)mem < &userstack)
+		return mp->size == KZMEM_SIZE_HEAP && tlsf_check(heap, mp);
+	if (dram_heap && (unsigned long)mp >= DRAM_START && (unsigned long)mem < DRAM_START + DRAM_SIZE)
+		return mp->size == KZMEM_SIZE_DRAM && tlsf_check(dram_heap, mp);
+
+	// プールの領域は，ブロックの先頭に一致するかを見る（ブロックのサイズは2の累乗なのでマスクで判定できる）
+	for (i = 0; i < MEMORY_AREA_NUM; i++)
+	{
+		if ((char *)mp >= area && (char *)mp < area + pool[i].size * pool[i].num)
+			return !(((char *)mp - area) & (pool[i].size - 1));
+		area += pool[i].size * pool[i].num;
+	}
+
+	return 0;
+}
+
+// 可変長ヒープのブロックを所有スレッドごと回収する（tlsf_walk()のコールバック）
+static void kzmem_reclaim_heap(void *ptr, void *arg)
+{
+	kzmem_block *mp = ptr;
+
+	if (mp->owner == *(kz_thread_id_t *)arg)
+		kzmem_free(mp + 1);
+}
+
+// どこから？
+// 『kozos.c』の『thread_run関数』
+// 指定したスレッドが所有しているブロックをまとめて解放する
+// スレッドの終了後，そのTCBが再利用される時に呼ばれる（同じTCBアドレス＝同じスレッドIDになってしまう前に回収する）
+void kzmem_reclaim(kz_thread_id_t owner)
+{
+	int i, j;
+	kzmem_block *mp;
+	extern char freearea;
+	char *area = &freearea;
+
+	if (!owner)
+		return;
+
+	// プールは切り分けた時と同じ順に並んでいるので，先頭から順に見ていく
+	// 解放済みのブロックの所有スレッドは0なので一致しない
+	for (i = 0; i < MEMORY_AREA_NUM; i++)
+	{
+		for (j = 0; j < pool[i].num; j++)
+		{
+			mp = (kzmem_block *)area;
+			if (mp->owner == owner)
+				kzmem_free(mp + 1);
+			area += pool[i].size;
+		}
+	}
+
+	tlsf_walk(heap, kzmem_reclaim_heap, &owner);
+	if (dram_heap)
+		tlsf_walk(dram_heap, kzmem_reclaim_heap, &owner);
+}
+
+// オブジェクト・キャッシュ ----------------------------------------------------------------------------------
+
+/*
+	カーネル内部の構造体（メッセージバッファなど）専用の固定長プール
+	起動時に個数分の領域をまとめて確保しておき，アプリケーションが使う汎用のプール・ヒープとは共有しない．
+	アプリケーションがメモリを使い切っても，カーネルの処理は影響を受けない．
+	空きオブジェクトの先頭に次の空きオブジェクトのポインタを置くので，ヘッダは不要
+*/
+struct _kzmem_cache
+{
+	char *name;	  // 名前（枯渇時の表示用）
+	int size;	  // オブジェクトのサイズ
+	int num;	  // オブジェクトの個数
+	int used;	  // 使用中の個数
+	int fail;	  // 枯渇して獲得できなかった回数
+	void *free;	  // 空きリストの先頭
+	char *area;	  // 確保した領域（解放時の範囲チェックに使う）
+	long dummy[3]; // ダミーメンバでサイズ調整（乗算が発生しないように）
+};
+
+// キャッシュの最大数
+#define KZMEM_CACHE_NUM 4
+
+static kzmem_cache caches[KZMEM_CACHE_NUM];
+
+// どこから？
+// 『kozos.c』の『kz_start関数』
+// キャッシュの作成（スレッドが動き出す前に呼ぶ．確保した領域は解放しない）
+kzmem_cache *kzmem_cache_create(char *name, int size, int num)
+{
+	int i;
+	char *p;
+	kzmem_cache *cache;
+
+	for (i = 0; i < KZMEM_CACHE_NUM; i++)
+	{
+		if (!caches[i].name)
+			break;
+	}
+	if (i == KZMEM_CACHE_NUM)
+		return NULL;
+	cache = &caches[i];
+
+	// 空きリストのポインタが入る大きさにし，ワード境界に揃える
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	size = (size + 1) & ~1;
+
+	cache->area = kzmem_alloc(size * num);
+	cache->name = name;
+	cache->size = size;
+	cache->num = num;
+	cache->used = 0;
+	cache->fail = 0;
+	cache->free = NULL;
+
+	// 後ろから順に空きリストに繋ぐ（先頭から順に使われる）
+	for (i = num - 1; i >= 0; i--)
+	{
+		p = cache->area + size * i;
+		*(void **)p = cache->free;
+		cache->free = p;
+	}
+
+	return cache;
+}
+
+// どこから？
+// 『kozos.c』の『sendmsg関数』
+// 枯渇したらNULLを返す（止めるかどうかは呼び出し側が決める）
+void *kzmem_cache_alloc(kzmem_cache *cache)
+{
+	void *p = cache->free;
+
+	if (p == NULL)
+	{
+		cache->fail++;
+		return NULL;
+	}
+	cache->free = *(void **)p;
+	cache->used++;
+
+	return p;
+}
+
+// どこから？
+// 『kozos.c』の『recvmsg関数』
+void kzmem_cache_free(kzmem_cache *cache, void *obj)
+{
+	// 別のキャッシュやプールのポインタが渡された
+	if ((char *)obj < cache->area || (char *)obj >= cache->area + cache->size * cache->num)
+		kz_sysdown();
+
+	*(void **)obj = cache->free;
+	cache->free = obj;
+	cache->used--;
+}
+
+// 枯渇した回数（0ならまだ足りている）
+int kzmem_cache_fail(kzmem_cache *cache)
+{
+	return cache->fail;
+}
+
+char *kzmem_cache_name(kzmem_cache *cache)
+{
+	return cache->name;
+}
@@ -7,7 +7,33 @@ int kzmem_init(void);
 // 動的メモリ領域の獲得
 void *kzmem_alloc(int size);
 
-// 動的メモリ領域の解放
+// 外部DRAMからの動的メモリ領域の獲得（大容量のバッファ用．獲得できなければNULL）
+void *kzmem_alloc_dram(long size);
+
+// 動的メモリ領域の解放（DRAMから獲得した領域も同じ関数で解放する）
 void kzmem_free(void *mem);
 
+// 所有スレッドの設定・取得（スレッドごとの使用量の集計と，スレッド終了時の回収に使う）
+void kzmem_setowner(void *mem, kz_thread_id_t owner);
+kz_thread_id_t kzmem_owner(void *mem);
+// ブロックの実際のサイズ
+long kzmem_size(void *mem);
+// kzmemで獲得したブロックか？
+int kzmem_check(void *mem);
+// 指定スレッドが所有するブロックをすべて解放
+void kzmem_reclaim(kz_thread_id_t owner);
+
+// カーネル内部の構造体専用のオブジェクト・キャッシュ
+typedef struct _kzmem_cache kzmem_cache;
+kzmem_cache *kzmem_cache_create(char *name, int size, int num);
+void *kzmem_cache_alloc(kzmem_cache *cache);
+void kzmem_cache_free(kzmem_cache *cache, void *obj);
+int kzmem_cache_fail(kzmem_cache *cache);
+char *kzmem_cache_name(kzmem_cache *cache);
+
+#ifdef KZMEM_DEBUG
+// メモリ破壊を検出した時に呼ばれる（実体はkozos.c．原因のスレッドと呼び出し元を表示して停止する）
+void kz_memfault(char *reason, void *mem);
+#endif
+
 #endif
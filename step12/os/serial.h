@@ -4,11 +4,21 @@
 #define _SERIAL_H_INCLUDED_
 
 int serial_init(int index); // デバイス初期化
+int serial_set_baud(int index, unsigned long bps, int *errp); // ボーレートの設定（誤差を千分率で返す）
 
 int serial_is_send_enable(int index);			  // 送信可能か？
 int serial_send_byte(int index, unsigned char b); // 1文字送信
 int serial_is_recv_enable(int index);			  // 受信可能か？
 unsigned char serial_recv_byte(int index);		  // 1文字受信
+int serial_clear_error(int index);				  // 受信エラーのクリア
+// serial_clear_error()が返すエラーの種類（SSRのビット）
+#define SERIAL_ERR_PER (1 << 3)	 // パリティエラー
+#define SERIAL_ERR_FER (1 << 4)	 // フレーミングエラー
+#define SERIAL_ERR_ORER (1 << 5) // オーバーラン（RDRを読む前に次の文字が来た）
+
+void serial_flow_init(int index);			 // RTS/CTSのポートの初期化
+void serial_set_rts(int index, int on);		 // RTSの設定
+int serial_is_cts(int index);				 // CTS（相手が受信できるか？）
 
 int serial_intr_is_send_enable(int index); // 送信割込み有効か？
 void serial_intr_send_enable(int index);   // 送信割込み有効化
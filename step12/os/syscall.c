@@ -89,10 +89,23 @@ void *kz_kmalloc(int size)
 {
 	kz_syscall_param_t param;
 	param.un.kmalloc.size = size;
+	param.un.kmalloc.caller = __builtin_return_address(0);
 	kz_syscall(KZ_SYSCALL_TYPE_KMALLOC, &param);
 	return param.un.kmalloc.ret;
 }
 
+// 外部DRAMからのメモリ領域の獲得用関数
+// 大きなバッファ（受信バッファやトレース用など）向け．獲得できなければNULLを返す
+// 解放はkz_kmfree()で行う
+void *kz_kmalloc_dram(long size)
+{
+	kz_syscall_param_t param;
+	param.un.kmalloc.size = size;
+	param.un.kmalloc.caller = __builtin_return_address(0);
+	kz_syscall(KZ_SYSCALL_TYPE_KMALLOC_DRAM, &param);
+	return param.un.kmalloc.ret;
+}
+
 // どこから？
 // 『test10_1.c』の『test10_1_main関数』
 // メモリ領域の解放用関数
@@ -101,6 +114,7 @@ int kz_kmfree(void *p)
 {
 	kz_syscall_param_t param;
 	param.un.kmfree.p = p;
+	param.un.kmfree.caller = __builtin_return_address(0);
 	kz_syscall(KZ_SYSCALL_TYPE_KMFREE, &param);
 	return param.un.kmfree.ret;
 }
@@ -19,6 +19,7 @@ typedef enum
 	KZ_SYSCALL_TYPE_SEND,
 	KZ_SYSCALL_TYPE_RECV,
 	KZ_SYSCALL_TYPE_SETINTR,
+	KZ_SYSCALL_TYPE_KMALLOC_DRAM,
 } kz_syscall_type_t;
 
 // システムコールのパラメータ領域
@@ -64,12 +65,14 @@ typedef struct
 		} chpri;
 		struct
 		{
-			int size;
+			long size; // DRAMからは64Kバイトを超えて獲得できるのでlong
+			void *caller; // 呼び出し元のアドレス（メモリ破壊の検出時に表示する）
 			void *ret;
-		} kmalloc;
+		} kmalloc; // kz_kmalloc_dram()も同じパラメータを使う
 		struct
 		{
 			char *p;
+			void *caller; // 呼び出し元のアドレス（メモリ破壊の検出時に表示する）
 			int ret;
 		} kmfree;
 		struct
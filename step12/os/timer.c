@@ -0,0 +1,91 @@
+// 8ビットタイマ用のデバイスドライバの本体
+
+/*
+	H8/3069Fの8ビットタイマ（TMR0〜TMR3）をワンショットタイマとして使う
+		- クロックはφ/8192（20MHzで約0.41ミリ秒ごとにカウント）
+		- TCNTがTCORAと一致したら割込み（コンペアマッチA）を入れて止める
+	8ビットなので，数えられるのは最大で255カウント（約100ミリ秒）まで
+*/
+
+#include "defines.h"
+#include "timer.h"
+
+// TMR0/TMR1とTMR2/TMR3はそれぞれレジスタが交互に並んでいる
+#define H8_3069F_TMR01 ((volatile struct h8_3069f_tmr *)0xffff80)
+#define H8_3069F_TMR23 ((volatile struct h8_3069f_tmr *)0xffff90)
+
+struct h8_3069f_tmr
+{
+	volatile uint8 tcr[2];	 // タイマコントロール
+	volatile uint8 tcsr[2];	 // タイマコントロール/ステータス
+	volatile uint8 tcora[2]; // タイムコンスタントA
+	volatile uint8 tcorb[2]; // タイムコンスタントB
+	volatile uint8 tcnt[2];	 // タイマカウンタ
+};
+
+// TCRの各ビットの定義
+#define H8_3069F_TMR_TCR_CKS_8192 (3 << 0)	   // クロック φ/8192
+#define H8_3069F_TMR_TCR_CCLR_CMA (1 << 3)	   // コンペアマッチAでカウンタクリア
+#define H8_3069F_TMR_TCR_CMIEA (1 << 6)		   // コンペアマッチA割込み有効
+
+// TCSRの各ビットの定義
+#define H8_3069F_TMR_TCSR_CMFA (1 << 6) // コンペアマッチAが起きた
+
+static struct
+{
+	volatile struct h8_3069f_tmr *tmr;
+	int ch; // ユニット内のチャネル（0 or 1）
+} regs[TIMER_NUM] = {
+	{H8_3069F_TMR01, 0},
+	{H8_3069F_TMR01, 1},
+	{H8_3069F_TMR23, 0},
+	{H8_3069F_TMR23, 1},
+};
+
+// どこから？
+// 『consdrv.c』の『consdrv_intrproc関数』
+int timer_start(int index, int msec)
+{
+	volatile struct h8_3069f_tmr *tmr = regs[index].tmr;
+	int ch = regs[index].ch;
+	int count;
+
+	if (msec < 1)
+		msec = 1;
+	if (msec > TIMER_MSEC_MAX)
+		msec = TIMER_MSEC_MAX;
+	// 1ミリ秒は約2.44カウント．2.5倍で近似する（掛け算はシフトで）
+	count = (msec << 1) + (msec >> 1);
+	if (count > 255)
+		count = 255;
+
+	tmr->tcr[ch] = 0;
+	tmr->tcsr[ch] &= ~H8_3069F_TMR_TCSR_CMFA;
+	tmr->tcnt[ch] = 0;
+	tmr->tcora[ch] = count;
+	tmr->tcr[ch] = H8_3069F_TMR_TCR_CMIEA | H8_3069F_TMR_TCR_CCLR_CMA | H8_3069F_TMR_TCR_CKS_8192;
+
+	return 0;
+}
+
+void timer_cancel(int index)
+{
+	volatile struct h8_3069f_tmr *tmr = regs[index].tmr;
+	int ch = regs[index].ch;
+
+	tmr->tcr[ch] = 0;
+	tmr->tcsr[ch] &= ~H8_3069F_TMR_TCSR_CMFA;
+}
+
+int timer_is_expired(int index)
+{
+	return (regs[index].tmr->tcsr[regs[index].ch] & H8_3069F_TMR_TCSR_CMFA) ? 1 : 0;
+}
+
+// どこから？
+// 『consdrv.c』の『consdrv_timer_intr関数』
+// CMFAを落とさないと割込みが入り続ける．ワンショットなのでカウントも止める
+void timer_expire(int index)
+{
+	timer_cancel(index);
+}
@@ -0,0 +1,16 @@
+// 8ビットタイマ用のデバイスドライバのヘッダファイル
+
+#ifndef _TIMER_H_INCLUDED_
+#define _TIMER_H_INCLUDED_
+
+// 8ビットタイマのチャネル数（TMR0〜TMR3）
+#define TIMER_NUM 4
+// 設定できる最大の時間（ミリ秒）
+#define TIMER_MSEC_MAX 100
+
+int timer_start(int index, int msec); // ワンショットタイマの開始（動作中なら最初から数え直す）
+void timer_cancel(int index);		  // タイマの停止
+int timer_is_expired(int index);	  // 満了したか？
+void timer_expire(int index);		  // 満了割込みの解除（タイマは止まる）
+
+#endif
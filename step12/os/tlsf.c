@@ -0,0 +1,446 @@
+#include "defines.h"
+#include "lib.h"
+#include "tlsf.h"
+
+/*
+	TLSF(Two-Level Segregated Fit)
+	空きブロックをサイズごとに２段階で分類したリストで管理する．
+		- 第１レベル(fl)... サイズの最上位ビットの位置（2の累乗ごとの区分）
+		- 第２レベル(sl)... 第１レベルの区間をさらに等分した区分
+	各レベルに「空きブロックがあるリスト」のビットマップを持たせておけば，
+	ビット検索だけで要求サイズ以上の空きブロックが見つかるので，獲得・解放はO(1)で終わる．
+*/
+
+// アライメント（H8はワード単位のアクセスなので最低2バイト．下位2ビットをフラグに使うため4バイトにする）
+#define TLSF_ALIGN_LOG2 2
+#define TLSF_ALIGN (1 << TLSF_ALIGN_LOG2)
+
+// 第２レベルの分割数（RAMが少ないので4分割に抑える）
+#define TLSF_SL_INDEX_COUNT_LOG2 2
+#define TLSF_SL_INDEX_COUNT (1 << TLSF_SL_INDEX_COUNT_LOG2)
+
+// 扱えるブロックサイズの上限（2Mバイト未満．外部DRAMの全体を一つのブロックにできる大きさ）
+#define TLSF_FL_INDEX_MAX 21
+#define TLSF_FL_INDEX_SHIFT (TLSF_SL_INDEX_COUNT_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_FL_INDEX_COUNT (TLSF_FL_INDEX_MAX - TLSF_FL_INDEX_SHIFT + 1)
+
+// これより小さいブロックは第１レベル0番にまとめて，第２レベルを線形に割り当てる
+#define TLSF_SMALL_BLOCK_SIZE (1 << TLSF_FL_INDEX_SHIFT)
+
+#define TLSF_BLOCK_SIZE_MAX (1UL << TLSF_FL_INDEX_MAX)
+
+/*
+	ブロック・ヘッダ
+	獲得済みの時は prev_phys と size だけがヘッダで，next_free 以降はデータ領域として利用者に渡す．
+	空きの時は，データ領域の先頭に空きリストのポインタを置く．
+*/
+typedef struct _tlsf_block
+{
+	// 物理的に直前にあるブロック（解放時の結合に使う）
+	struct _tlsf_block *prev_phys;
+	// データ領域のサイズ（下位ビットはフラグ）
+	uint32 size;
+
+	// 以下は空きブロックの時のみ有効
+	struct _tlsf_block *next_free;
+	struct _tlsf_block *prev_free;
+} tlsf_block;
+
+#define TLSF_BLOCK_FREE (1 << 0) // 空きブロック
+#define TLSF_BLOCK_FLAGS (TLSF_ALIGN - 1)
+
+// ヘッダ部分のサイズ（データ領域は next_free の位置から始まる）
+#define TLSF_BLOCK_HEADER_SIZE (sizeof(struct _tlsf_block *) + sizeof(uint32))
+// 空きリストのポインタを格納できる最小のデータ領域
+#define TLSF_BLOCK_SIZE_MIN (sizeof(tlsf_block) - TLSF_BLOCK_HEADER_SIZE)
+
+// 管理構造体
+// 領域の先頭に置く（領域ごとに持つので，内蔵RAMと外部DRAMで別々に管理できる）
+struct _tlsf_control
+{
+	// 第１レベルのビットマップ（空きリストがある第１レベルのビットが立つ）
+	uint32 fl_bitmap;
+	// 第２レベルのビットマップ
+	uint8 sl_bitmap[TLSF_FL_INDEX_COUNT];
+	// 空きリストの先頭
+	// 1行が2の累乗バイトになるので，インデックス計算で乗算は発生しない
+	tlsf_block *blocks[TLSF_FL_INDEX_COUNT][TLSF_SL_INDEX_COUNT];
+	// 末尾の番兵（tlsf_check()で，ブロックが領域の中にあるかを見るのに使う）
+	tlsf_block *sentinel;
+};
+
+// ビット操作 ----------------------------------------------------------------------------
+
+// 最上位の1のビット位置（0なら-1）
+// ビルトイン関数は使えないので二分探索で求める．分岐の回数は常に5回で一定
+static int tlsf_fls(uint32 word)
+{
+	int bit = 31;
+
+	if (!word)
+		return -1;
+	if (!(word & 0xffff0000))
+	{
+		word <<= 16;
+		bit -= 16;
+	}
+	if (!(word & 0xff000000))
+	{
+		word <<= 8;
+		bit -= 8;
+	}
+	if (!(word & 0xf0000000))
+	{
+		word <<= 4;
+		bit -= 4;
+	}
+	if (!(word & 0xc0000000))
+	{
+		word <<= 2;
+		bit -= 2;
+	}
+	if (!(word & 0x80000000))
+		bit -= 1;
+
+	return bit;
+}
+
+// 最下位の1のビット位置（0なら-1）
+// 最下位ビットだけを取り出してから最上位ビットを探す
+static int tlsf_ffs(uint32 word)
+{
+	return tlsf_fls(word & (~word + 1));
+}
+
+// ブロックの操作 --------------------------------------------------------------------------
+
+static uint32 block_size(tlsf_block *block)
+{
+	return block->size & ~(uint32)TLSF_BLOCK_FLAGS;
+}
+
+static int block_is_free(tlsf_block *block)
+{
+	return block->size & TLSF_BLOCK_FREE;
+}
+
+// データ領域のアドレスからブロック・ヘッダを得る
+static tlsf_block *block_from_ptr(void *ptr)
+{
+	return (tlsf_block *)((char *)ptr - TLSF_BLOCK_HEADER_SIZE);
+}
+
+static void *block_to_ptr(tlsf_block *block)
+{
+	return (char *)block + TLSF_BLOCK_HEADER_SIZE;
+}
+
+// 物理的に直後にあるブロック
+static tlsf_block *block_next(tlsf_block *block)
+{
+	return (tlsf_block *)((char *)block_to_ptr(block) + block_size(block));
+}
+
+// サイズからリストの位置(fl, sl)を求める -------------------------------------------------------
+
+// 解放時用: そのサイズが属するリスト
+static void mapping_insert(uint32 size, int *fli, int *sli)
+{
+	int fl, sl;
+
+	if (size < TLSF_SMALL_BLOCK_SIZE)
+	{
+		// 小さいブロックは線形に並べる
+		fl = 0;
+		sl = (int)size >> TLSF_ALIGN_LOG2;
+	}
+	else
+	{
+		fl = tlsf_fls(size);
+		// 最上位ビットの次の数ビットが第２レベルになる
+		sl = (int)(size >> (fl - TLSF_SL_INDEX_COUNT_LOG2)) ^ TLSF_SL_INDEX_COUNT;
+		fl -= (TLSF_FL_INDEX_SHIFT - 1);
+	}
+	*fli = fl;
+	*sli = sl;
+}
+
+// 獲得時用: そのリストにあるブロックなら必ず要求サイズ以上になるよう，切り上げてから求める
+static void mapping_search(uint32 size, int *fli, int *sli)
+{
+	if (size >= TLSF_SMALL_BLOCK_SIZE)
+		size += (1UL << (tlsf_fls(size) - TLSF_SL_INDEX_COUNT_LOG2)) - 1;
+	mapping_insert(size, fli, sli);
+}
+
+// 空きリストの操作 -----------------------------------------------------------------------
+
+// (fl, sl)以上で空きがある最小のリストの先頭を探す
+static tlsf_block *search_suitable_block(tlsf_control *tlsf, int *fli, int *sli)
+{
+	int fl = *fli;
+	int sl = *sli;
+	uint32 sl_map, fl_map;
+
+	// 同じ第１レベル内で，sl以上の空きリストを探す
+	sl_map = tlsf->sl_bitmap[fl] & (~0UL << sl);
+	if (!sl_map)
+	{
+		// 無ければ，より大きい第１レベルを探す
+		fl_map = tlsf->fl_bitmap & (~0UL << (fl + 1));
+		if (!fl_map)
+			return NULL; // メモリ不足
+
+		fl = tlsf_ffs(fl_map);
+		sl_map = tlsf->sl_bitmap[fl];
+	}
+	sl = tlsf_ffs(sl_map);
+
+	*fli = fl;
+	*sli = sl;
+	return tlsf->blocks[fl][sl];
+}
+
+static void remove_free_block(tlsf_control *tlsf, tlsf_block *block, int fl, int sl)
+{
+	tlsf_block *prev = block->prev_free;
+	tlsf_block *next = block->next_free;
+
+	if (next)
+		next->prev_free = prev;
+	if (prev)
+		prev->next_free = next;
+
+	// リストの先頭だった場合は先頭を差し替え，空になったらビットマップを落とす
+	if (tlsf->blocks[fl][sl] == block)
+	{
+		tlsf->blocks[fl][sl] = next;
+		if (next == NULL)
+		{
+			tlsf->sl_bitmap[fl] &= ~(1 << sl);
+			if (!tlsf->sl_bitmap[fl])
+				tlsf->fl_bitmap &= ~(1UL << fl);
+		}
+	}
+}
+
+static void insert_free_block(tlsf_control *tlsf, tlsf_block *block, int fl, int sl)
+{
+	tlsf_block *current = tlsf->blocks[fl][sl];
+
+	// リストの先頭に繋ぐ
+	block->next_free = current;
+	block->prev_free = NULL;
+	if (current)
+		current->prev_free = block;
+	tlsf->blocks[fl][sl] = block;
+
+	tlsf->fl_bitmap |= (1UL << fl);
+	tlsf->sl_bitmap[fl] |= (1 << sl);
+}
+
+static void block_remove(tlsf_control *tlsf, tlsf_block *block)
+{
+	int fl, sl;
+	mapping_insert(block_size(block), &fl, &sl);
+	remove_free_block(tlsf, block, fl, sl);
+}
+
+static void block_insert(tlsf_control *tlsf, tlsf_block *block)
+{
+	int fl, sl;
+	mapping_insert(block_size(block), &fl, &sl);
+	insert_free_block(tlsf, block, fl, sl);
+}
+
+// 要求サイズより十分大きければ，後ろを切り出して空きリストに戻す
+static void block_trim(tlsf_control *tlsf, tlsf_block *block, uint32 size)
+{
+	tlsf_block *remaining;
+	uint32 rest;
+
+	if (block_size(block) < size + TLSF_BLOCK_HEADER_SIZE + TLSF_BLOCK_SIZE_MIN)
+		return;
+
+	rest = block_size(block) - size - TLSF_BLOCK_HEADER_SIZE;
+	remaining = (tlsf_block *)((char *)block_to_ptr(block) + size);
+	remaining->prev_phys = block;
+	remaining->size = rest | TLSF_BLOCK_FREE;
+	block_next(remaining)->prev_phys = remaining;
+	block->size = size | (block->size & TLSF_BLOCK_FLAGS);
+
+	block_insert(tlsf, remaining);
+}
+
+// 管理構造体の直後が最初のブロック
+static tlsf_block *block_first(tlsf_control *tlsf)
+{
+	return (tlsf_block *)(((uint32)(tlsf + 1) + TLSF_ALIGN - 1) & ~(uint32)(TLSF_ALIGN - 1));
+}
+
+// 管理領域の作成 -----------------------------------------------------------------------
+
+// どこから？
+// 『memory.c』の『kzmem_init関数』
+/*
+	mem -> ----------------------
+	       | tlsf_control       |
+	       ----------------------
+	       | 空きブロック         |
+	       |                    |
+	       ----------------------
+	       | 番兵（サイズ0, 使用中）| <- 最後のブロックの結合をここで止める
+	       ----------------------
+*/
+tlsf_control *tlsf_create(void *mem, long bytes)
+{
+	tlsf_control *tlsf;
+	tlsf_block *block, *sentinel;
+	uint32 start, end, size;
+
+	start = ((uint32)mem + TLSF_ALIGN - 1) & ~(uint32)(TLSF_ALIGN - 1);
+	end = ((uint32)mem + bytes) & ~(uint32)(TLSF_ALIGN - 1);
+
+	tlsf = (tlsf_control *)start;
+	start = (uint32)block_first(tlsf);
+
+	// 管理構造体・ブロック・ヘッダ・番兵のヘッダすら入らない
+	if (end <= start + TLSF_BLOCK_HEADER_SIZE * 2 + TLSF_BLOCK_SIZE_MIN)
+		return NULL;
+
+	memset(tlsf, 0, sizeof(*tlsf));
+
+	size = end - start - TLSF_BLOCK_HEADER_SIZE * 2;
+	if (size >= TLSF_BLOCK_SIZE_MAX)
+		size = TLSF_BLOCK_SIZE_MAX - TLSF_ALIGN;
+
+	block = (tlsf_block *)start;
+	block->prev_phys = NULL;
+	block->size = size | TLSF_BLOCK_FREE;
+
+	sentinel = block_next(block);
+	sentinel->prev_phys = block;
+	sentinel->size = 0;
+	tlsf->sentinel = sentinel;
+
+	block_insert(tlsf, block);
+
+	return tlsf;
+}
+
+// 獲得と解放 -------------------------------------------------------------------------
+
+// どこから？
+// 『memory.c』の『kzmem_alloc関数』
+void *tlsf_malloc(tlsf_control *tlsf, long size)
+{
+	int fl, sl;
+	uint32 adjust;
+	tlsf_block *block;
+
+	if (size <= 0)
+		return NULL;
+
+	// アライメントに切り上げる
+	adjust = ((uint32)size + TLSF_ALIGN - 1) & ~(uint32)(TLSF_ALIGN - 1);
+	if (adjust < TLSF_BLOCK_SIZE_MIN)
+		adjust = TLSF_BLOCK_SIZE_MIN;
+	if (adjust >= TLSF_BLOCK_SIZE_MAX)
+		return NULL;
+
+	mapping_search(adjust, &fl, &sl);
+	if (fl >= TLSF_FL_INDEX_COUNT)
+		return NULL; // 切り上げるとリストの範囲外になる
+	block = search_suitable_block(tlsf, &fl, &sl);
+	if (block == NULL)
+		return NULL;
+
+	remove_free_block(tlsf, block, fl, sl);
+	block_trim(tlsf, block, adjust);
+	block->size &= ~(uint32)TLSF_BLOCK_FREE;
+
+	return block_to_ptr(block);
+}
+
+// どこから？
+// 『memory.c』の『kzmem_free関数』
+void tlsf_free(tlsf_control *tlsf, void *ptr)
+{
+	tlsf_block *block, *prev, *next;
+
+	if (ptr == NULL)
+		return;
+
+	block = block_from_ptr(ptr);
+	block->size |= TLSF_BLOCK_FREE;
+
+	// 直前が空きなら結合
+	prev = block->prev_phys;
+	if (prev && block_is_free(prev))
+	{
+		block_remove(tlsf, prev);
+		prev->size += block_size(block) + TLSF_BLOCK_HEADER_SIZE;
+		block = prev;
+	}
+
+	// 直後が空きなら結合（番兵は使用中なので末尾を越えることはない）
+	next = block_next(block);
+	if (block_is_free(next))
+	{
+		block_remove(tlsf, next);
+		block->size += block_size(next) + TLSF_BLOCK_HEADER_SIZE;
+	}
+	block_next(block)->prev_phys = block;
+
+	block_insert(tlsf, block);
+}
+
+long tlsf_block_size(void *ptr)
+{
+	return block_size(block_from_ptr(ptr));
+}
+
+// どこから？
+// 『memory.c』の『kzmem_check関数』
+// ptrがtlsf_malloc()で獲得済みのブロックのデータ領域を指しているか
+// 利用者のデータの途中を指すポインタでは，ヘッダらしき値があっても，
+// 直後のブロックが指す直前のブロック（prev_phys）が自分に一致することはまず無い
+int tlsf_check(tlsf_control *tlsf, void *ptr)
+{
+	tlsf_block *block = block_from_ptr(ptr);
+	tlsf_block *next;
+
+	if ((uint32)ptr & (TLSF_ALIGN - 1))
+		return 0;
+	if (block < block_first(tlsf) || block >= tlsf->sentinel)
+		return 0;
+	if (block_is_free(block) || !block_size(block))
+		return 0;
+	if (block_size(block) > (uint32)tlsf->sentinel - (uint32)ptr)
+		return 0;
+	next = block_next(block);
+	return next->prev_phys == block;
+}
+
+// どこから？
+// 『memory.c』の『kzmem_reclaim関数』
+// 獲得済みのブロックを物理的な並び順に辿る
+void tlsf_walk(tlsf_control *tlsf, void (*func)(void *ptr, void *arg), void *arg)
+{
+	tlsf_block *block, *next;
+
+	// 番兵（サイズ0）に着いたら終わり
+	for (block = block_first(tlsf); block_size(block); block = next)
+	{
+		/*
+			コールバックでblockが解放されると，直後の空きブロックと結合されてヘッダが無効になる．
+			空きブロックは連続しない（必ず結合される）ので，先に「次の獲得済みブロック（か番兵）」を求めておく
+		*/
+		next = block_next(block);
+		if (block_is_free(next))
+			next = block_next(next);
+
+		if (!block_is_free(block))
+			func(block_to_ptr(block), arg);
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef _KOZOS_TLSF_H_INCLUDED_
+#define _KOZOS_TLSF_H_INCLUDED_
+
+// TLSF(Two-Level Segregated Fit)による可変長メモリ管理
+// 獲得・解放ともにブロック数に依存しない一定時間(O(1))で終わるので，割込み禁止区間で使っても最悪時間が読める
+
+// TLSFの管理構造体（中身はtlsf.cのみが知っていればよい）
+typedef struct _tlsf_control tlsf_control;
+
+// 管理領域の作成（領域の先頭に管理構造体を置き，残りを一つの空きブロックにする）
+tlsf_control *tlsf_create(void *mem, long bytes);
+
+// 可変長メモリの獲得（獲得できなければNULL）
+void *tlsf_malloc(tlsf_control *tlsf, long size);
+
+// 可変長メモリの解放（前後の空きブロックとは即座に結合する）
+void tlsf_free(tlsf_control *tlsf, void *ptr);
+
+// 獲得済みブロックの実際のデータ領域サイズ
+long tlsf_block_size(void *ptr);
+// 獲得済みのブロックを指しているか（解放済みや，データ領域の途中を指すポインタなら0）
+int tlsf_check(tlsf_control *tlsf, void *ptr);
+
+// 獲得済みのブロックを先頭から順に辿る（コールバックの中でそのブロックを解放してもよい）
+void tlsf_walk(tlsf_control *tlsf, void (*func)(void *ptr, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+	ブートローダのsloadコマンドにファイルを送るツール（ホストのPCで動かす）
+	ビルド: cc -O2 -o ksend ksend.c
+	使い方: ksend [-b ボーレート] [-s 転送中のボーレート] シリアルデバイス ファイル
+		例) ksend -b 9600 /dev/ttyUSB0 kozos.lz
+		例) ksend -s 57600 /dev/ttyUSB0 kozos.lz
+	kzload> で sload と入力してから起動する（起動してから入力してもよい）
+	-sを付けた時は，kzload> が出ている状態で起動する
+		speedコマンドで速度を上げてからsloadコマンドを送り，転送が終わったら（失敗しても）元の速度に戻す
+		速度を上げられなければ，元の速度のまま送る
+		ボードが20MHzなら57600bps（ホストが対応していれば76800bps）まで．115200bpsは誤差が大きく設定できない
+	プロトコルはbootload/sload.hを参照
+	ACKを待たずにウィンドウの分まで続けて送り，エラーの時は受信側が指定した位置から送り直す
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+// bootload/sload.hと合わせる
+#define FRAME_MAX 256
+#define WINDOW 2048
+
+#define SYNC0 0xaa
+#define SYNC1 0x55
+#define READY 'W'
+#define ACK 'A'
+#define RESUME 'R'
+#define END 'E'
+#define CAN 0x18
+
+#define TIMEOUT_MSEC 1000 // これだけ応答が無ければ，ACKされた位置から送り直す
+#define RETRY_MAX 10
+
+// bootload/main.cのspeedコマンドと合わせる
+#define SPEED_CONFIRM_MSEC 5000 // 受信側が新しい速度で改行を待つ時間
+#define PROMPT "kzload> "
+
+static int fd;
+static unsigned long crc_table[256];
+
+static void crc_init(void)
+{
+	unsigned long c;
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320UL : (c >> 1);
+		crc_table[i] = c;
+	}
+}
+
+static unsigned long crc_update(unsigned long crc, const unsigned char *buf, long len)
+{
+	while (len-- > 0)
+		crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+// ボードで設定できる速度だけを受け付ける（bootload/serial.cのSERIAL_BAUD_ERROR_MAXの所を参照）
+// 115200bpsは20MHzでは誤差が8.5%になり必ず断られるので，ここで止める
+static speed_t baud(long bps)
+{
+	switch (bps)
+	{
+	case 9600:
+		return B9600;
+	case 19200:
+		return B19200;
+	case 38400:
+		return B38400;
+	case 57600:
+		return B57600;
+#ifdef B76800
+	// Linuxには無い
+	case 76800:
+		return B76800;
+#endif
+	}
+	fprintf(stderr, "unsupported baud rate: %ld\n", bps);
+	exit(1);
+}
+
+static int serial_open(const char *dev, long bps)
+{
+	struct termios tio;
+
+	if ((fd = open(dev, O_RDWR | O_NOCTTY)) < 0)
+	{
+		perror(dev);
+		return -1;
+	}
+	memset(&tio, 0, sizeof(tio));
+	tio.c_cflag = CS8 | CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, baud(bps));
+	cfsetospeed(&tio, baud(bps));
+	tcflush(fd, TCIOFLUSH);
+	return tcsetattr(fd, TCSANOW, &tio);
+}
+
+// 送信し終えてから速度を変える
+static void serial_speed(long bps)
+{
+	struct termios tio;
+
+	tcdrain(fd);
+	tcgetattr(fd, &tio);
+	cfsetispeed(&tio, baud(bps));
+	cfsetospeed(&tio, baud(bps));
+	tcsetattr(fd, TCSANOW, &tio);
+	tcflush(fd, TCIFLUSH);
+}
+
+static void write_all(const unsigned char *buf, long len)
+{
+	long n;
+
+	while (len > 0)
+	{
+		if ((n = write(fd, buf, len)) < 0)
+		{
+			perror("write");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+// フレームの送信
+static void send_frame(const unsigned char *data, long offset, int len)
+{
+	unsigned char frame[2 + 6 + FRAME_MAX + 4];
+	unsigned long crc;
+	int n = 0;
+
+	frame[n++] = SYNC0;
+	frame[n++] = SYNC1;
+	frame[n++] = offset >> 24;
+	frame[n++] = offset >> 16;
+	frame[n++] = offset >> 8;
+	frame[n++] = offset;
+	frame[n++] = len >> 8;
+	frame[n++] = len;
+	memcpy(&frame[n], data + offset, len);
+	n += len;
+	crc = crc_update(0xffffffffUL, &frame[2], 6 + len) ^ 0xffffffffUL;
+	frame[n++] = crc >> 24;
+	frame[n++] = crc >> 16;
+	frame[n++] = crc >> 8;
+	frame[n++] = crc;
+	write_all(frame, n);
+}
+
+// 受信側からの応答を1つ受け取る（種類を返し，位置を*offsetに入れる．タイムアウトなら-1）
+static int recv_reply(long *offset, int msec)
+{
+	static unsigned char buf[5];
+	static int len = 0;
+	unsigned char c;
+	fd_set fds;
+	struct timeval tv;
+
+	for (;;)
+	{
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = msec / 1000;
+		tv.tv_usec = (msec % 1000) * 1000;
+		if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0)
+			return -1;
+		if (read(fd, &c, 1) != 1)
+			continue;
+
+		if (len == 0)
+		{
+			if (c == READY || c == CAN)
+				return c;
+			if (c != ACK && c != RESUME && c != END)
+				continue; // エコーバックなどは読み捨てる
+		}
+		buf[len++] = c;
+		if (len == 5)
+		{
+			len = 0;
+			*offset = ((long)buf[1] << 24) | ((long)buf[2] << 16) | ((long)buf[3] << 8) | buf[4];
+			return buf[0];
+		}
+	}
+}
+
+// 受信側の出力にsが現れるまで読む（見つかれば0，タイムアウトなら-1）
+static int wait_string(const char *s, int msec)
+{
+	const char *p = s;
+	unsigned char c;
+	fd_set fds;
+	struct timeval tv;
+
+	while (*p)
+	{
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = msec / 1000;
+		tv.tv_usec = (msec % 1000) * 1000;
+		if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0)
+			return -1;
+		if (read(fd, &c, 1) != 1)
+			continue;
+		if (c == *p)
+			p++;
+		else
+			p = (c == *s) ? s + 1 : s;
+	}
+	return 0;
+}
+
+static void write_string(const char *s)
+{
+	write_all((const unsigned char *)s, strlen(s));
+}
+
+// ブートローダのspeedコマンドで，fromからtoに速度を切り替える（失敗したらfromのまま-1を返す）
+static int change_speed(long from, long to)
+{
+	char cmd[32];
+
+	snprintf(cmd, sizeof(cmd), "speed %ld\r", to);
+	write_string(cmd);
+	if (wait_string("enter at the new speed.", 1000) < 0)
+		return -1;
+
+	// 切り替わった受信側に，新しい速度で改行を送る
+	serial_speed(to);
+	usleep(50000);
+	write_string("\r");
+	if (wait_string("speed ok.", 1000) == 0 && wait_string(PROMPT, 1000) == 0)
+		return 0;
+
+	// 受信側は改行が届かなければ元の速度に戻る
+	serial_speed(from);
+	wait_string(PROMPT, SPEED_CONFIRM_MSEC + 1000);
+	return -1;
+}
+
+static int send_file(unsigned char *data, long size);
+
+int main(int argc, char *argv[])
+{
+	FILE *fp;
+	unsigned char *data;
+	long size, bps = 9600, fast = 0;
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "b:s:")) != -1)
+	{
+		if (opt == 'b')
+			bps = atol(optarg);
+		else if (opt == 's')
+			fast = atol(optarg);
+		else
+			break;
+	}
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "usage: %s [-b baud] [-s baud] device file\n", argv[0]);
+		return 1;
+	}
+	if (fast)
+		baud(fast); // 対応していない速度ならここで終了
+
+	if ((fp = fopen(argv[optind + 1], "rb")) == NULL)
+	{
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = malloc(size ? size : 1);
+	if (!data || fread(data, 1, size, fp) != (size_t)size)
+	{
+		fprintf(stderr, "%s: read error\n", argv[optind + 1]);
+		return 1;
+	}
+	fclose(fp);
+
+	crc_init();
+	if (serial_open(argv[optind], bps) < 0)
+		return 1;
+
+	if (!fast)
+		return send_file(data, size);
+
+	// 速度を上げてから，sloadコマンドも送る
+	write_string("\r");
+	if (wait_string(PROMPT, 1000) < 0)
+	{
+		fprintf(stderr, "no prompt.\n");
+		return 1;
+	}
+	if (change_speed(bps, fast) < 0)
+	{
+		fprintf(stderr, "cannot change speed to %ld. use %ld.\n", fast, bps);
+		fast = 0;
+	}
+	write_string("sload\r");
+	r = send_file(data, size);
+
+	// 転送が終わったら（失敗しても）元の速度に戻す
+	if (fast)
+	{
+		wait_string(PROMPT, 15000); // 失敗した時は受信側のタイムアウト（10秒）を待つ
+		if (change_speed(fast, bps) < 0)
+			fprintf(stderr, "cannot restore speed to %ld.\n", bps);
+	}
+	return r;
+}
+
+static int send_file(unsigned char *data, long size)
+{
+	long next, acked, offset;
+	int c, len, retry;
+
+	// 受信側の準備ができるのを待つ
+	fprintf(stderr, "waiting for sload...\n");
+	while ((c = recv_reply(&offset, 60000)) != READY)
+	{
+		if (c < 0)
+		{
+			fprintf(stderr, "no response.\n");
+			return 1;
+		}
+	}
+
+	next = acked = 0;
+	retry = 0;
+	while (acked < size)
+	{
+		// ウィンドウの分まで，ACKを待たずに続けて送る
+		// 受信バッファはちょうどWINDOWバイトなので，フレームの終わりがacked + WINDOWを越えないようにする
+		// （越えたフレームは受信側で捨てられ，送り直しになる）
+		while (next < size && next - acked < WINDOW)
+		{
+			len = (size - next > FRAME_MAX) ? FRAME_MAX : size - next;
+			if (len > acked + WINDOW - next)
+				len = acked + WINDOW - next;
+			send_frame(data, next, len);
+			next += len;
+		}
+
+		c = recv_reply(&offset, TIMEOUT_MSEC);
+		if (c == ACK)
+		{
+			if (offset > acked)
+			{
+				acked = offset;
+				retry = 0;
+				fprintf(stderr, "\r%ld/%ld", acked, size);
+			}
+		}
+		else if (c == RESUME)
+		{
+			// エラーがあったので，指定された位置から送り直す
+			if (offset >= acked && offset <= size)
+				next = offset;
+		}
+		else if (c == CAN)
+		{
+			fprintf(stderr, "\ncanceled by receiver.\n");
+			return 1;
+		}
+		else if (c < 0)
+		{
+			// 応答が無い（ACKかRESUMEが失われた）ので，ACKされた位置から送り直す
+			if (++retry > RETRY_MAX)
+			{
+				fprintf(stderr, "\ntimeout.\n");
+				return 1;
+			}
+			next = acked;
+		}
+	}
+
+	// ファイルの終わりを知らせる（'E'が返るまで繰り返す）
+	for (retry = 0; retry < RETRY_MAX; retry++)
+	{
+		send_frame(data, size, 0);
+		while ((c = recv_reply(&offset, TIMEOUT_MSEC)) >= 0 && c != END && c != CAN)
+			;
+		if (c == END)
+		{
+			fprintf(stderr, "\ndone.\n");
+			return 0;
+		}
+		if (c == CAN)
+			break;
+	}
+
+	fprintf(stderr, "\nfailed.\n");
+	return 1;
+}
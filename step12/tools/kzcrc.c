@@ -0,0 +1,65 @@
+/*
+	イメージの末尾にCRC-32のトレイラを付けるツール（ホストのPCで動かす）
+	使い方: kzcrc 入力ファイル 出力ファイル
+	トレイラの形式はbootload/imgcrc.hを参照．ブートローダは受信しながら検査し，合わなければrunしない
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[])
+{
+	FILE *in, *out;
+	unsigned long crc = 0xffffffffUL, table[256], c, size = 0;
+	unsigned char trailer[12] = {'K', 'Z', 'C', 'R'};
+	int i, j, ch;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: %s input output\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320UL : (c >> 1);
+		table[i] = c;
+	}
+
+	if ((in = fopen(argv[1], "rb")) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	if ((out = fopen(argv[2], "wb")) == NULL)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+
+	while ((ch = getc(in)) != EOF)
+	{
+		crc = table[(crc ^ ch) & 0xff] ^ (crc >> 8);
+		putc(ch, out);
+		size++;
+	}
+	crc ^= 0xffffffffUL;
+
+	for (i = 0; i < 4; i++)
+	{
+		trailer[4 + i] = size >> (24 - i * 8);
+		trailer[8 + i] = crc >> (24 - i * 8);
+	}
+	fwrite(trailer, 1, sizeof(trailer), out);
+
+	fclose(in);
+	if (fclose(out))
+	{
+		perror(argv[2]);
+		return 1;
+	}
+
+	return 0;
+}
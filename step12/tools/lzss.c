@@ -0,0 +1,141 @@
+/*
+	ブートローダに送るイメージをLZSSで圧縮するツール（ホストのPCで動かす）
+	使い方: lzss 入力ファイル 出力ファイル
+	形式はbootload/lzss.hを参照．展開はbootload/lzss.cが受信しながら行う
+	（シリアルの転送量が減るので，その分loadが速くなる）
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WINDOW_SIZE 4096 // 参照できる距離（bootload/lzss.hのLZSS_WINDOW_SIZEと合わせる）
+#define THRESHOLD 3		 // 参照の最小の長さ
+#define MAX_LEN (15 + THRESHOLD)
+
+// 3バイトのハッシュで，同じハッシュの過去の位置を辿って最長一致を探す
+#define HASH_SIZE 4096
+#define HASH(p) ((((p)[0] << 4) ^ ((p)[1] << 2) ^ (p)[2]) & (HASH_SIZE - 1))
+#define CHAIN_MAX 256
+
+int main(int argc, char *argv[])
+{
+	FILE *fp;
+	unsigned char *in, *out, *flagp;
+	long size, pos, outlen, i, cand, best_len, best_dist, len;
+	long head[HASH_SIZE], *prev;
+	int bit, chain;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "usage: %s input output\n", argv[0]);
+		return 1;
+	}
+
+	if ((fp = fopen(argv[1], "rb")) == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	in = malloc(size + MAX_LEN);
+	prev = malloc(sizeof(long) * (size + 1));
+	// 最悪でも8バイトごとにフラグが1バイト増えるだけ
+	out = malloc(8 + size + size / 8 + 2);
+	if (!in || !prev || !out || fread(in, 1, size, fp) != (size_t)size)
+	{
+		fprintf(stderr, "%s: read error\n", argv[1]);
+		return 1;
+	}
+	fclose(fp);
+	memset(in + size, 0, MAX_LEN);
+
+	// ヘッダ（マジックナンバと展開後のサイズ）
+	memcpy(out, "KZLZ", 4);
+	out[4] = size >> 24;
+	out[5] = size >> 16;
+	out[6] = size >> 8;
+	out[7] = size;
+	outlen = 8;
+
+	for (i = 0; i < HASH_SIZE; i++)
+		head[i] = -1;
+
+	flagp = NULL;
+	bit = 8;
+	pos = 0;
+	while (pos < size)
+	{
+		// 8個ごとにフラグの1バイトを置く
+		if (bit == 8)
+		{
+			flagp = &out[outlen++];
+			*flagp = 0;
+			bit = 0;
+		}
+
+		// 最長一致を探す
+		best_len = 0;
+		best_dist = 0;
+		if (pos + THRESHOLD <= size)
+		{
+			chain = 0;
+			for (cand = head[HASH(in + pos)]; cand >= 0 && pos - cand <= WINDOW_SIZE && chain < CHAIN_MAX; cand = prev[cand], chain++)
+			{
+				for (len = 0; len < MAX_LEN && pos + len < size && in[cand + len] == in[pos + len]; len++)
+					;
+				if (len > best_len)
+				{
+					best_len = len;
+					best_dist = pos - cand;
+					if (len == MAX_LEN)
+						break;
+				}
+			}
+		}
+
+		if (best_len >= THRESHOLD)
+		{
+			// 参照（距離-1の12ビットと長さ-3の4ビット）
+			out[outlen++] = (best_dist - 1) >> 4;
+			out[outlen++] = (((best_dist - 1) & 0xf) << 4) | (best_len - THRESHOLD);
+		}
+		else
+		{
+			// そのままの1バイト
+			*flagp |= 1 << bit;
+			out[outlen++] = in[pos];
+			best_len = 1;
+		}
+		bit++;
+
+		// 進めた分の位置をハッシュに登録する
+		for (; best_len > 0; best_len--, pos++)
+		{
+			if (pos + THRESHOLD <= size)
+			{
+				i = HASH(in + pos);
+				prev[pos] = head[i];
+				head[i] = pos;
+			}
+		}
+	}
+
+	if ((fp = fopen(argv[2], "wb")) == NULL)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+	if (fwrite(out, 1, outlen, fp) != (size_t)outlen)
+	{
+		fprintf(stderr, "%s: write error\n", argv[2]);
+		return 1;
+	}
+	fclose(fp);
+
+	fprintf(stderr, "%ld -> %ld bytes (%ld%%)\n", size, outlen, size ? outlen * 100 / size : 0);
+
+	return 0;
+}